@@ -1,6 +1,6 @@
 pkgname = "man-pages"
 pkgver = "6.15"
-pkgrel = 0
+pkgrel = 1
 hostmakedepends = ["gsed", "bash"]
 pkgdesc = "Linux Documentation Project manual pages"
 license = "GPL-2.0-or-later"
@@ -26,6 +26,7 @@ def install(self):
     with self.pushd(self.destdir / "usr/share/man"):
         self.rm("man1/time.1")
         self.rm("man1/getent.1")
+        self.rm("man1/iconv.1")
         self.rm("man3/getspnam.3")
         self.rm("man5/passwd.5")
         self.rm("man5/tzfile.5")
@@ -1,6 +1,6 @@
 pkgname = "musl-cross"
 pkgver = "1.2.5_git20240705"
-pkgrel = 2
+pkgrel = 5
 _commit = "dd1e63c3638d5f9afb857fccf6ce1415ca5f1b8b"
 _mimalloc_ver = "2.1.7"
 build_style = "gnu_configure"
@@ -46,6 +46,10 @@ def post_extract(self):
     # copy in our mimalloc unified source
     self.cp(self.files_path / "mimalloc-verify-syms.sh", ".")
     self.cp(self.files_path / "mimalloc.c", "mimalloc/src")
+    # catalog lookup through the .mo hash table
+    self.cp(self.files_path / "__mo_lookup.c", "src/locale")
+    # plural rules compiled once per catalog
+    self.cp(self.files_path / "pleval.c", "src/locale")
     # now we're ready to get patched
     # but also remove musl's x86_64 asm memcpy as it's actually
     # noticeably slower than the c implementation
@@ -0,0 +1,108 @@
+/*
+ * Replacement for musl's src/locale/__mo_lookup.c, copied over it in
+ * post_extract. Catalogs written by msgfmt carry a hash table of their
+ * original strings, which is now used to find a message in O(1) probes;
+ * catalogs without one, and strings the table does not lead to, still
+ * go through the binary search over the sorted original strings.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "locale_impl.h"
+
+static inline uint32_t swapc(uint32_t x, int c)
+{
+	return c ? x>>24 | x>>8&0xff00 | x<<8&0xff0000 | x<<24 : x;
+}
+
+/* hashpjw as in GNU gettext's hash-string.h. It folds only bits 28-31
+ * back in; any bits an unsigned long holds above those never reach the
+ * low 32, so computing in 32 bits gives the same table index. */
+static uint32_t mo_hash(const char *s)
+{
+	uint32_t h = 0, g;
+
+	while (*s) {
+		h = (h<<4) + (unsigned char)*s++;
+		if ((g = h & 0xf0000000)) {
+			h ^= g >> 24;
+			h ^= g;
+		}
+	}
+	return h;
+}
+
+static const char *mo_string(const void *p, size_t size, uint32_t l, uint32_t o)
+{
+	if (o >= size || l >= size-o || ((const char *)p)[o+l])
+		return 0;
+	return (const char *)p + o;
+}
+
+static const char *mo_hashed(const void *p, size_t size, const char *s,
+	uint32_t n, uint32_t o, uint32_t t, int sw)
+{
+	const uint32_t *mo = p;
+	uint32_t hs, ho, h, idx, incr, i, k;
+	const char *os;
+
+	if (size < 7*4) return 0;
+	hs = swapc(mo[5], sw);
+	ho = swapc(mo[6], sw);
+	if (hs < 3 || ho%4 || ho >= size || hs > (size-ho)/4)
+		return 0;
+	ho /= 4;
+	h = mo_hash(s);
+	idx = h % hs;
+	incr = 1 + h % (hs-2);
+	for (i = 0; i < hs; i++) {
+		k = swapc(mo[ho+idx], sw);
+		if (!k) return 0;
+		if (--k < n) {
+			os = mo_string(p, size, swapc(mo[o+2*k], sw),
+				swapc(mo[o+2*k+1], sw));
+			if (!os) return 0;
+			if (!strcmp(s, os))
+				return mo_string(p, size, swapc(mo[t+2*k], sw),
+					swapc(mo[t+2*k+1], sw));
+		}
+		if (idx >= hs-incr) idx -= hs-incr;
+		else idx += incr;
+	}
+	return 0;
+}
+
+const char *__mo_lookup(const void *p, size_t size, const char *s)
+{
+	const uint32_t *mo = p;
+	int sw = *mo - 0x950412de;
+	uint32_t b = 0, n = swapc(mo[2], sw);
+	uint32_t o = swapc(mo[3], sw);
+	uint32_t t = swapc(mo[4], sw);
+	const char *os, *ts;
+	int sign;
+
+	if (n>=size/8 || o>size-8*n || t>size-8*n || ((o|t)%4))
+		return 0;
+	o/=4;
+	t/=4;
+	if ((ts = mo_hashed(p, size, s, n, o, t, sw)))
+		return ts;
+	if (!n) return 0;
+	for (;;) {
+		os = mo_string(p, size, swapc(mo[o+2*(b+n/2)], sw),
+			swapc(mo[o+2*(b+n/2)+1], sw));
+		if (!os) return 0;
+		sign = strcmp(s, os);
+		if (!sign)
+			return mo_string(p, size, swapc(mo[t+2*(b+n/2)], sw),
+				swapc(mo[t+2*(b+n/2)+1], sw));
+		else if (n == 1) return 0;
+		else if (sign < 0)
+			n /= 2;
+		else {
+			b += n/2;
+			n -= n/2;
+		}
+	}
+}
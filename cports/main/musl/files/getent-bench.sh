@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# getent-bench.sh
+# Time of getent lookups of many keys in generated passwd, group,
+# services, shells and hosts files, for each getent given, checking
+# that they all print the same, in the same order.  The hosts keys
+# are looked up as hosts and as ahosts.  The files are bind-mounted
+# over the ones in /etc in a private mount namespace, so it needs
+# unshare(1) and user namespaces, or root:
+#
+#   sh getent-bench.sh ./getent.old ./getent
+#
+# Not installed, and not run by the check phase of the package: the
+# build root has neither unshare(1) nor mount(8), so it is for running
+# by hand against a getent from an earlier build.
+#
+# -n  entries per file (default: 100000)
+# -k  keys looked up per database (default: 1000)
+#
+# The keys are all in the files: a key given as an argument that is
+# not found ends the lookup, and getent still scans the file for one
+# that is not in its index.
+#
+
+entries=100000
+keys=1000
+
+while getopts n:k: opt; do
+	case $opt in
+	n) entries=$OPTARG ;;
+	k) keys=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n entries] [-k keys] getent ..." >&2
+	exit 1
+fi
+
+if [ -z "$GETENT_BENCH_NS" ]; then
+	GETENT_BENCH_NS=1 exec unshare -rm sh "$0" -n "$entries" -k "$keys" "$@"
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+awk -v n="$entries" -v d="$dir" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		printf "u%d:x:%d:%d:user %d:/home/u%d:/bin/sh\n",
+			i, 10000 + i, 10000 + i % 1000, i, i > d "/passwd"
+		printf "g%d:x:%d:u%d,u%d\n", i, 10000 + i, i, (i * 7) % n \
+			> d "/group"
+		printf "s%d\t%d/%s\ta%d\n", i / 2, 1 + i / 2 % 65535,
+			i % 2 ? "udp" : "tcp", i > d "/services"
+		printf "/bin/sh%d\n", i > d "/shells"
+		printf "10.%d.%d.%d\th%d.example h%d\n", i / 65536 % 256,
+			i / 256 % 256, i % 256, i, i > d "/hosts"
+	}
+}' || exit 1
+
+# keys spread over the whole file, by name and by number
+awk -v n="$entries" -v k="$keys" -v d="$dir" 'BEGIN {
+	srand(1)
+	for (i = 0; i < k; i++) {
+		j = int(rand() * n)
+		printf "u%d\n", j > d "/passwd.keys"
+		printf "%d\n", 10000 + j > d "/group.keys"
+		printf "s%d%s\n", j / 2, i % 3 ? "" : "/udp" > d "/services.keys"
+		printf "/bin/sh%d\n", j > d "/shells.keys"
+		printf "h%d\n", j > d "/hosts.keys"
+	}
+}' || exit 1
+
+for db in passwd group services shells hosts; do
+	mount --bind "$dir/$db" "/etc/$db" || exit 1
+done
+
+now() {
+	date +%s%N
+}
+
+printf '%-9s' database
+for g in "$@"; do
+	printf ' %12s' "${g##*/}"
+done
+printf '\n'
+status=0
+for db in passwd group services shells hosts ahosts; do
+	printf '%-9s' "$db"
+	n=0
+	for g in "$@"; do
+		t=$(now)
+		"$g" "$db" $(cat "$dir/${db#a}.keys") > "$dir/out.$n" 2>/dev/null
+		t=$(( $(now) - t ))
+		printf ' %9d.%ds' $((t / 1000000000)) $((t / 100000000 % 10))
+		if [ $n -gt 0 ] && ! cmp -s "$dir/out.0" "$dir/out.$n"; then
+			printf ' (differs)'
+			status=1
+		fi
+		n=$((n + 1))
+	done
+	printf '\n'
+done
+exit $status
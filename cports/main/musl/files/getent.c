@@ -34,6 +34,7 @@
 
 #include <sys/socket.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
@@ -48,6 +49,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <paths.h>
+#include <pthread.h>
 #include <err.h>
 
 #include <arpa/inet.h>
@@ -67,6 +69,42 @@ enum {
 
 static int usage(const char *);
 
+/*
+ * setoutbuf --
+ *	entries are printed one line at a time; when stdout is a
+ *	file or a pipe, buffer it in chunks sized for that file
+ *	instead of the (small) stdio default
+ */
+static void setoutbuf(void)
+{
+	static char	buf[128 * 1024];
+	struct stat	st;
+
+	if (fstat(STDOUT_FILENO, &st) != 0 ||
+	    (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode)))
+		return;
+	(void)setvbuf(stdout, buf, _IOFBF,
+	    st.st_blksize > 64 * 1024 ? sizeof(buf) : 64 * 1024);
+}
+
+/* keys read from stdin are all looked up, see stdinkeys() */
+static bool	keepgoing;
+
+/*
+ * notfound --
+ *	a key was not found: returns true when the lookup should stop
+ *	there, otherwise reports the key and lets it go on with the next
+ */
+static bool notfound(const char *key)
+{
+	if (!keepgoing)
+		return true;
+	/* after the entries printed before it, when both go to one file */
+	fflush(stdout);
+	warnx("%s: not found", key);
+	return false;
+}
+
 static int parsenum(const char *word, unsigned long *result)
 {
 	unsigned long	num;
@@ -110,6 +148,127 @@ static void printfmtstrings(char *strings[], const char *prefix, const char *sep
 	(void)printf("\n");
 }
 
+/*
+ * Lookups of more than INDEXKEYS keys in the file-backed databases
+ * enumerate the database once into hash tables, which then answer the
+ * keys instead of a scan of the file per key.  A key maps to the first
+ * entry the enumeration returns for it, as in the libc lookups, and a
+ * key that is not in the tables still goes to them, for entries that
+ * do not come from the file.
+ */
+#define	INDEXKEYS	4
+
+struct index {
+	size_t		size;
+	size_t		count;
+	struct {
+		char	*key;
+		void	*ent;
+	}		*slot;
+};
+
+static void *emalloc(size_t len)
+{
+	void	*p;
+
+	if ((p = malloc(len)) == NULL)
+		err(RV_USAGE, NULL);
+	return p;
+}
+
+static char *estrdup(const char *str)
+{
+	char	*p;
+
+	if (str == NULL)
+		return NULL;
+	if ((p = strdup(str)) == NULL)
+		err(RV_USAGE, NULL);
+	return p;
+}
+
+static char **estrvdup(char *strv[])
+{
+	char	**p;
+	size_t	i, n;
+
+	for (n = 0; strv[n] != NULL; n++)
+		continue;
+	p = emalloc((n + 1) * sizeof(*p));
+	for (i = 0; i < n; i++)
+		p[i] = estrdup(strv[i]);
+	p[n] = NULL;
+	return p;
+}
+
+static size_t hashkey(const char *key)
+{
+	size_t	h;
+
+	for (h = 2166136261u; *key != '\0'; key++)
+		h = (h ^ (unsigned char)*key) * 16777619u;
+	return h;
+}
+
+/*
+ * indexfind --
+ *	the slot of key in ix: the one holding it, or else the
+ *	empty one it would go to
+ */
+static size_t indexfind(const struct index *ix, const char *key)
+{
+	size_t	i;
+
+	i = hashkey(key) & (ix->size - 1);
+	while (ix->slot[i].key != NULL && strcmp(ix->slot[i].key, key) != 0)
+		i = (i + 1) & (ix->size - 1);
+	return i;
+}
+
+static void indexadd(struct index *ix, const char *key, void *ent)
+{
+	struct index	old;
+	size_t		i, j;
+
+	if (key == NULL)
+		return;
+	if (2 * (ix->count + 1) > ix->size) {
+		old = *ix;
+		ix->size = old.size != 0 ? 2 * old.size : 1024;
+		ix->slot = emalloc(ix->size * sizeof(*ix->slot));
+		memset(ix->slot, 0, ix->size * sizeof(*ix->slot));
+		for (i = 0; i < old.size; i++) {
+			if (old.slot[i].key == NULL)
+				continue;
+			j = indexfind(ix, old.slot[i].key);
+			ix->slot[j] = old.slot[i];
+		}
+		free(old.slot);
+	}
+	i = indexfind(ix, key);
+	if (ix->slot[i].key != NULL)
+		return;
+	ix->slot[i].key = estrdup(key);
+	ix->slot[i].ent = ent;
+	ix->count++;
+}
+
+static void *indexget(const struct index *ix, const char *key)
+{
+	size_t	i;
+
+	if (ix->size == 0 || key == NULL)
+		return NULL;
+	i = indexfind(ix, key);
+	return ix->slot[i].ent;
+}
+
+static const char *numkey(char *buf, size_t len, unsigned long num)
+{
+	(void)snprintf(buf, len, "%lu", num);
+	return buf;
+}
+
 static int ethers(int argc, char *argv[])
 {
 	char		hostname[MAXHOSTNAMELEN + 1], *hp;
@@ -128,13 +287,17 @@ static int ethers(int argc, char *argv[])
 			hp = argv[i];
 			if (ether_hostton(hp, eap) != 0) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 		} else {
 			hp = hostname;
 			if (ether_ntohost(hp, eap) != 0) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 		}
 		(void)printf("%-17s  %s\n", ether_ntoa(eap), hp);
@@ -148,10 +311,36 @@ static void groupprint(const struct group *gr)
 			gr->gr_name, gr->gr_passwd, gr->gr_gid);
 }
 
+static struct index	grbyname, grbygid;
+
+static void groupindex(void)
+{
+	static bool	done;
+	struct group	*gr, *e;
+	char		buf[32];
+
+	if (done)
+		return;
+	done = true;
+	setgrent();
+	while ((gr = getgrent()) != NULL) {
+		e = emalloc(sizeof(*e));
+		e->gr_name = estrdup(gr->gr_name);
+		e->gr_passwd = estrdup(gr->gr_passwd);
+		e->gr_gid = gr->gr_gid;
+		e->gr_mem = estrvdup(gr->gr_mem);
+		indexadd(&grbyname, e->gr_name, e);
+		indexadd(&grbygid,
+		    numkey(buf, sizeof(buf), (unsigned long)e->gr_gid), e);
+	}
+	endgrent();
+}
+
 static int group(int argc, char *argv[])
 {
 	struct group	*gr;
 	unsigned long	id;
+	char		buf[32];
 	int		i, rv;
 
 	rv = RV_OK;
@@ -159,14 +348,24 @@ static int group(int argc, char *argv[])
 		while ((gr = getgrent()) != NULL)
 			groupprint(gr);
 	} else {
+		if (argc - 2 > INDEXKEYS)
+			groupindex();
 		for (i = 2; i < argc; i++) {
-			if (parsenum(argv[i], &id))
-				gr = getgrgid((gid_t)id);
-			else
-				gr = getgrnam(argv[i]);
+			if (parsenum(argv[i], &id)) {
+				gr = indexget(&grbygid, numkey(buf, sizeof(buf),
+				    (unsigned long)(gid_t)id));
+				if (gr == NULL)
+					gr = getgrgid((gid_t)id);
+			} else {
+				gr = indexget(&grbyname, argv[i]);
+				if (gr == NULL)
+					gr = getgrnam(argv[i]);
+			}
 			if (gr == NULL) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 			groupprint(gr);
 		}
@@ -184,8 +383,137 @@ static void hostsprint(const struct hostent *he)
 	printfmtstrings(he->h_aliases, "  ", " ", "%-16s  %s", buf, he->h_name);
 }
 
+/*
+ * Lookups of several hosts are resolved concurrently, by up to
+ * NRESOLVERS threads taking the keys in turn, while the main thread
+ * prints the answers in the order of the keys as they come in.  All
+ * of the keys are looked up, so each one that is not found is
+ * reported.
+ */
+#define	NRESOLVERS	16
+
+struct lookup {
+	const char	*key;
+	bool		done;
+	int		error;
+	struct addrinfo	*res;		/* ahosts */
+	struct hostent	he, *hp;	/* hosts */
+	char		*buf;
+	size_t		len;
+};
+
+struct resolver {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct lookup	*lk;
+	int		n, next;
+	void		(*fn)(struct lookup *, const void *);
+	const void	*arg;
+	pthread_t	tid[NRESOLVERS];
+	int		nthread;
+};
+
+static void *resolveworker(void *arg)
+{
+	struct resolver	*rs = arg;
+	int		i;
+
+	for (;;) {
+		pthread_mutex_lock(&rs->lock);
+		i = rs->next++;
+		pthread_mutex_unlock(&rs->lock);
+		if (i >= rs->n)
+			return NULL;
+		(*rs->fn)(&rs->lk[i], rs->arg);
+		pthread_mutex_lock(&rs->lock);
+		rs->lk[i].done = true;
+		pthread_cond_broadcast(&rs->cond);
+		pthread_mutex_unlock(&rs->lock);
+	}
+}
+
+/*
+ * resolvestart --
+ *	start looking up the keys with fn, each in its struct lookup;
+ *	without threads, they are all looked up before it returns
+ */
+static struct lookup *resolvestart(struct resolver *rs, int n, char *keys[],
+	void (*fn)(struct lookup *, const void *), const void *arg)
+{
+	int	i;
+
+	pthread_mutex_init(&rs->lock, NULL);
+	pthread_cond_init(&rs->cond, NULL);
+	rs->lk = emalloc(n * sizeof(*rs->lk));
+	memset(rs->lk, 0, n * sizeof(*rs->lk));
+	for (i = 0; i < n; i++)
+		rs->lk[i].key = keys[i];
+	rs->n = n;
+	rs->next = 0;
+	rs->fn = fn;
+	rs->arg = arg;
+	for (rs->nthread = 0; rs->nthread < MIN(n, NRESOLVERS); rs->nthread++)
+		if (pthread_create(&rs->tid[rs->nthread], NULL, resolveworker,
+		    rs) != 0)
+			break;
+	if (rs->nthread == 0)
+		(void)resolveworker(rs);
+	return rs->lk;
+}
+
+static void resolvewait(struct resolver *rs, int i)
+{
+	pthread_mutex_lock(&rs->lock);
+	while (!rs->lk[i].done)
+		pthread_cond_wait(&rs->cond, &rs->lock);
+	pthread_mutex_unlock(&rs->lock);
+}
+
+static void resolveend(struct resolver *rs)
+{
+	int	i;
+
+	for (i = 0; i < rs->nthread; i++)
+		pthread_join(rs->tid[i], NULL);
+	pthread_mutex_destroy(&rs->lock);
+	pthread_cond_destroy(&rs->cond);
+	free(rs->lk);
+}
+
+static void hostsresolve(struct lookup *lk, const void *arg)
+{
+	char	addr[IN6ADDRSZ], *p;
+	int	af, herr, i;
+
+	for (lk->len = 1024; ; lk->len *= 2) {
+		if ((p = realloc(lk->buf, lk->len)) == NULL) {
+			lk->error = ENOMEM;
+			return;
+		}
+		lk->buf = p;
+		if (inet_pton(AF_INET6, lk->key, (void *)addr) > 0)
+			lk->error = gethostbyaddr_r(addr, IN6ADDRSZ, AF_INET6,
+			    &lk->he, lk->buf, lk->len, &lk->hp, &herr);
+		else if (inet_pton(AF_INET, lk->key, (void *)addr) > 0)
+			lk->error = gethostbyaddr_r(addr, INADDRSZ, AF_INET,
+			    &lk->he, lk->buf, lk->len, &lk->hp, &herr);
+		else {
+			for (i = 0, af = AF_INET6; i < 2; i++, af = AF_INET) {
+				lk->error = gethostbyname2_r(lk->key, af,
+				    &lk->he, lk->buf, lk->len, &lk->hp, &herr);
+				if (lk->hp != NULL || lk->error == ERANGE)
+					break;
+			}
+		}
+		if (lk->error != ERANGE)
+			return;
+	}
+}
+
 static int hosts(int argc, char *argv[])
 {
+	struct resolver	rs;
+	struct lookup	*lk;
 	struct hostent	*he;
 	char		addr[IN6ADDRSZ];
 	int		i, rv;
@@ -195,6 +523,20 @@ static int hosts(int argc, char *argv[])
 	if (argc == 2) {
 		while ((he = gethostent()) != NULL)
 			hostsprint(he);
+	} else if (argc > 3) {
+		lk = resolvestart(&rs, argc - 2, argv + 2, hostsresolve, NULL);
+		for (i = 0; i < argc - 2; i++) {
+			resolvewait(&rs, i);
+			if (lk[i].hp != NULL)
+				hostsprint(lk[i].hp);
+			else {
+				rv = RV_NOTFOUND;
+				fflush(stdout);
+				warnx("%s: not found", lk[i].key);
+			}
+			free(lk[i].buf);
+		}
+		resolveend(&rs);
 	} else {
 		for (i = 2; i < argc; i++) {
 			if (inet_pton(AF_INET6, argv[i], (void *)addr) > 0)
@@ -205,7 +547,9 @@ static int hosts(int argc, char *argv[])
 				he = gethostbyname2(argv[i], AF_INET);
 			if (he == NULL) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 			hostsprint(he);
 		}
@@ -214,7 +558,7 @@ static int hosts(int argc, char *argv[])
 	return rv;
 }
 
-static int ahosts_ex(int family, int flags, int argc, char *argv[])
+static void ahostsprint(const struct addrinfo *res)
 {
 	static const char *socktypes[] = {
 		[SOCK_STREAM]		= "STREAM",
@@ -227,9 +571,44 @@ static int ahosts_ex(int family, int flags, int argc, char *argv[])
 	};
 	const char *sockstr;
 	char sockbuf[16], buf[INET6_ADDRSTRLEN];
-	struct addrinfo *res, *r, hint;
+	const struct addrinfo *r;
 	void *addr;
-	int i;
+
+	for (r = res; r; r = r->ai_next) {
+		sockstr = NULL;
+		if (r->ai_socktype >= 0 && r->ai_socktype < sizeof(socktypes)/sizeof(socktypes[0]))
+			sockstr = socktypes[r->ai_socktype];
+		if (!sockstr) {
+			sprintf(buf, "%d", r->ai_socktype);
+			sockstr = sockbuf;
+		}
+		switch (r->ai_family) {
+		case AF_INET:
+			addr = &((struct sockaddr_in*) r->ai_addr)->sin_addr;
+			break;
+		case AF_INET6:
+			addr = &((struct sockaddr_in6*) r->ai_addr)->sin6_addr;
+			break;
+		default:
+			continue;
+		}
+		if (inet_ntop(r->ai_family, addr, buf, sizeof(buf)) == NULL)
+			(void)strlcpy(buf, "# unknown", sizeof(buf));
+		printf("%-15s %-6s %s\n", buf, sockstr, r->ai_canonname ?: "");
+	}
+}
+
+static void ahostsresolve(struct lookup *lk, const void *hint)
+{
+	lk->error = getaddrinfo(lk->key, 0, hint, &lk->res);
+}
+
+static int ahosts_ex(int family, int flags, int argc, char *argv[])
+{
+	struct resolver rs;
+	struct lookup *lk;
+	struct addrinfo *res, hint;
+	int i, rv;
 
 	if (argc == 2)
 		return hosts(argc, argv);
@@ -239,35 +618,31 @@ static int ahosts_ex(int family, int flags, int argc, char *argv[])
 		.ai_flags = AI_ADDRCONFIG | AI_CANONNAME | flags,
 	};
 
-	for (i = 2; i < argc; i++) {
-		if (getaddrinfo(argv[i], 0, &hint, &res) != 0)
-			return RV_NOTFOUND;
-
-		for (r = res; r; r = r->ai_next) {
-			sockstr = NULL;
-			if (r->ai_socktype >= 0 && r->ai_socktype < sizeof(socktypes)/sizeof(socktypes[0]))
-				sockstr = socktypes[r->ai_socktype];
-			if (!sockstr) {
-				sprintf(buf, "%d", r->ai_socktype);
-				sockstr = sockbuf;
-			}
-			switch (r->ai_family) {
-			case AF_INET:
-				addr = &((struct sockaddr_in*) r->ai_addr)->sin_addr;
-				break;
-			case AF_INET6:
-				addr = &((struct sockaddr_in6*) r->ai_addr)->sin6_addr;
-				break;
-			default:
+	rv = RV_OK;
+	if (argc > 3) {
+		lk = resolvestart(&rs, argc - 2, argv + 2, ahostsresolve, &hint);
+		for (i = 0; i < argc - 2; i++) {
+			resolvewait(&rs, i);
+			if (lk[i].error != 0) {
+				rv = RV_NOTFOUND;
+				fflush(stdout);
+				warnx("%s: not found", lk[i].key);
 				continue;
 			}
-			if (inet_ntop(r->ai_family, addr, buf, sizeof(buf)) == NULL)
-				(void)strlcpy(buf, "# unknown", sizeof(buf));
-			printf("%-15s %-6s %s\n", buf, sockstr, r->ai_canonname ?: "");
+			ahostsprint(lk[i].res);
+			freeaddrinfo(lk[i].res);
 		}
+		resolveend(&rs);
+		return rv;
 	}
 
-	return RV_OK;
+	if (getaddrinfo(argv[2], 0, &hint, &res) != 0) {
+		(void)notfound(argv[2]);
+		return RV_NOTFOUND;
+	}
+	ahostsprint(res);
+	freeaddrinfo(res);
+	return rv;
 }
 
 static int ahosts(int argc, char *argv[])
@@ -314,9 +689,11 @@ static int networks(int argc, char *argv[])
 				ne = getnetbyaddr(net, AF_INET);
 			else
 				ne = getnetbyname(argv[i]);
-			if (ne != NULL) {
+			if (ne == NULL) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 			networksprint(ne);
 		}
@@ -332,10 +709,38 @@ static void passwdprint(struct passwd *pw)
 		pw->pw_gid, pw->pw_gecos, pw->pw_dir, pw->pw_shell);
 }
 
+static struct index	pwbyname, pwbyuid;
+
+static void passwdindex(void)
+{
+	static bool	done;
+	struct passwd	*pw, *e;
+	char		buf[32];
+
+	if (done)
+		return;
+	done = true;
+	setpwent();
+	while ((pw = getpwent()) != NULL) {
+		e = emalloc(sizeof(*e));
+		*e = *pw;
+		e->pw_name = estrdup(pw->pw_name);
+		e->pw_passwd = estrdup(pw->pw_passwd);
+		e->pw_gecos = estrdup(pw->pw_gecos);
+		e->pw_dir = estrdup(pw->pw_dir);
+		e->pw_shell = estrdup(pw->pw_shell);
+		indexadd(&pwbyname, e->pw_name, e);
+		indexadd(&pwbyuid,
+		    numkey(buf, sizeof(buf), (unsigned long)e->pw_uid), e);
+	}
+	endpwent();
+}
+
 static int passwd(int argc, char *argv[])
 {
 	struct passwd	*pw;
 	unsigned long	id;
+	char		buf[32];
 	int		i, rv;
 
 	rv = RV_OK;
@@ -343,14 +748,24 @@ static int passwd(int argc, char *argv[])
 		while ((pw = getpwent()) != NULL)
 			passwdprint(pw);
 	} else {
+		if (argc - 2 > INDEXKEYS)
+			passwdindex();
 		for (i = 2; i < argc; i++) {
-			if (parsenum(argv[i], &id))
-				pw = getpwuid((uid_t)id);
-			else
-				pw = getpwnam(argv[i]);
+			if (parsenum(argv[i], &id)) {
+				pw = indexget(&pwbyuid, numkey(buf, sizeof(buf),
+				    (unsigned long)(uid_t)id));
+				if (pw == NULL)
+					pw = getpwuid((uid_t)id);
+			} else {
+				pw = indexget(&pwbyname, argv[i]);
+				if (pw == NULL)
+					pw = getpwnam(argv[i]);
+			}
 			if (pw == NULL) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 			passwdprint(pw);
 		}
@@ -384,7 +799,9 @@ static int protocols(int argc, char *argv[])
 				pe = getprotobyname(argv[i]);
 			if (pe == NULL) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 			protocolsprint(pe);
 		}
@@ -424,7 +841,11 @@ static int services(int argc, char *argv[])
 				se = getservbyname(argv[i], proto);
 			if (se == NULL) {
 				rv = RV_NOTFOUND;
-				break;
+				if (proto != NULL)
+					proto[-1] = '/';
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 			servicesprint(se);
 		}
@@ -447,7 +868,9 @@ static int shadow(int argc, char *argv[])
 			sp = getspnam(argv[i]);
 			if (sp == NULL) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 			putspent(sp, stdout);
 		}
@@ -456,6 +879,21 @@ static int shadow(int argc, char *argv[])
 	return rv;
 }
 
+static struct index	shbyname;
+
+static void shellsindex(void)
+{
+	static bool	done;
+	const char	*sh;
+
+	if (done)
+		return;
+	done = true;
+	setusershell();
+	while ((sh = getusershell()) != NULL)
+		indexadd(&shbyname, sh, estrdup(sh));
+}
+
 static int shells(int argc, char *argv[])
 {
 	const char	*sh;
@@ -467,7 +905,13 @@ static int shells(int argc, char *argv[])
 		while ((sh = getusershell()) != NULL)
 			(void)printf("%s\n", sh);
 	} else {
+		if (argc - 2 > INDEXKEYS)
+			shellsindex();
 		for (i = 2; i < argc; i++) {
+			if ((sh = indexget(&shbyname, argv[i])) != NULL) {
+				(void)printf("%s\n", sh);
+				continue;
+			}
 			setusershell();
 			while ((sh = getusershell()) != NULL) {
 				if (strcmp(sh, argv[i]) == 0) {
@@ -477,7 +921,9 @@ static int shells(int argc, char *argv[])
 			}
 			if (sh == NULL) {
 				rv = RV_NOTFOUND;
-				break;
+				if (notfound(argv[i]))
+					break;
+				continue;
 			}
 		}
 	}
@@ -511,6 +957,7 @@ static int usage(const char *arg0)
 	size_t i;
 
 	(void)fprintf(stderr, "Usage: %s database [key ...]\n", arg0);
+	(void)fprintf(stderr, "       %s [-0] database -\n", arg0);
 	(void)fprintf(stderr, "\tdatabase may be one of:");
 	for (i = 0, curdb = databases; curdb->name != NULL; curdb++, i++) {
 		if (i % 7 == 0)
@@ -523,16 +970,78 @@ static int usage(const char *arg0)
 	/* NOTREACHED */
 }
 
+#define	KEYBATCH	256
+
+/*
+ * stdinkeys --
+ *	look up the keys read from stdin, separated by sep, handing
+ *	them to the database in batches; a key that is not found is
+ *	reported and does not stop the others
+ */
+static int stdinkeys(struct getentdb *db, char *argv[], int sep)
+{
+	char		*args[KEYBATCH + 3], *line[KEYBATCH];
+	size_t		cap[KEYBATCH];
+	ssize_t		len;
+	int		n, r, rv;
+
+	memset(line, 0, sizeof(line));
+	memset(cap, 0, sizeof(cap));
+	args[0] = argv[0];
+	args[1] = argv[1];
+	keepgoing = true;
+	rv = RV_OK;
+	do {
+		for (n = 0; n < KEYBATCH; ) {
+			len = getdelim(&line[n], &cap[n], sep, stdin);
+			if (len < 0)
+				break;
+			if (len > 0 && line[n][len - 1] == sep)
+				line[n][--len] = '\0';
+			if (len > 0) {
+				args[2 + n] = line[n];
+				n++;
+			}
+		}
+		args[2 + n] = NULL;
+		if (n > 0 && (r = (*db->callback)(2 + n, args)) != RV_OK)
+			rv = r;
+	} while (n == KEYBATCH);
+	if (ferror(stdin)) {
+		warn("stdin");
+		rv = RV_USAGE;
+	}
+	for (n = 0; n < KEYBATCH; n++)
+		free(line[n]);
+	return rv;
+}
+
 int
 main(int argc, char *argv[])
 {
 	struct getentdb	*curdb;
+	int		sep;
 
+	sep = '\n';
+	if (argc > 1 && strcmp(argv[1], "-0") == 0) {
+		sep = '\0';
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
 	if (argc < 2)
 		usage(argv[0]);
-	for (curdb = databases; curdb->name != NULL; curdb++)
-		if (strcmp(curdb->name, argv[1]) == 0)
-			return (*curdb->callback)(argc, argv);
+	setoutbuf();
+	for (curdb = databases; curdb->name != NULL; curdb++) {
+		if (strcmp(curdb->name, argv[1]) != 0)
+			continue;
+		if (argc == 3 && (strcmp(argv[2], "-") == 0 ||
+		    strcmp(argv[2], "--stdin") == 0))
+			return stdinkeys(curdb, argv, sep);
+		if (sep == '\0')
+			usage(argv[0]);
+		return (*curdb->callback)(argc, argv);
+	}
 
 	warn("Unknown database `%s'", argv[1]);
 	usage(argv[0]);
@@ -0,0 +1,419 @@
+/*
+ * iconv-bench.c
+ * Throughput of iconv(3) and of the iconv utility over a fixed set of
+ * encoding pairs and generated corpora, compared against a baseline
+ * recorded by an earlier run. Not installed; the check phase of the
+ * package runs it when forced (cbuild --force-check pkg main/musl),
+ * against files/iconv-bench.baseline when there is one. By hand, run
+ * under the libc to be measured through its dynamic linker:
+ *
+ *   cc -O2 -o iconv-bench iconv-bench.c
+ *   lib/libc.so ./iconv-bench -l lib/libc.so -u ./iconv -w before.txt
+ *   lib/libc.so ./iconv-bench -l lib/libc.so -u ./iconv -b before.txt
+ *
+ * -u  the utility to run (default: iconv from PATH)
+ * -l  the dynamic linker to run the utility with (default: its own)
+ * -s  corpus size in MiB (default: 16)
+ * -r  runs per measurement, of which the best counts (default: 3)
+ * -w  record the results as a baseline
+ * -b  compare against a baseline, marking with ! any result more than
+ *     -t percent (default: 10) slower; timings vary too much from one
+ *     run to the next for that to be an error
+ *
+ * The corpora are generated from a fixed seed, so that they are the
+ * same from one run and one host to the next, as UTF-8 and converted
+ * to the source charset of each pair with iconv(3), leaving out what
+ * it cannot encode. libc need not be able to encode the double-byte
+ * charsets at all, so CJK text in those is generated as bytes instead,
+ * and is what UTF-8 text to convert to them is decoded from.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <iconv.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+enum { ASCII, LATIN, CJK, EMOJI, DIRTY, NCORPUS };
+
+static const char *cname[NCORPUS] = {
+	"ascii", "latin", "cjk", "emoji", "dirty",
+};
+
+static const struct pair {
+	const char *from, *to;
+	unsigned corpora;
+} pairs[] = {
+	{ "UTF-8", "UTF-8", 1<<ASCII | 1<<CJK | 1<<DIRTY },
+	{ "UTF-8", "UTF-16LE", 1<<ASCII | 1<<LATIN | 1<<CJK | 1<<EMOJI | 1<<DIRTY },
+	{ "UTF-16LE", "UTF-8", 1<<ASCII | 1<<LATIN | 1<<CJK | 1<<EMOJI },
+	{ "UTF-8", "UTF-32BE", 1<<LATIN | 1<<EMOJI },
+	{ "UTF-8", "ISO-8859-1", 1<<ASCII | 1<<LATIN | 1<<DIRTY },
+	{ "ISO-8859-1", "UTF-8", 1<<ASCII | 1<<LATIN },
+	{ "CP1252", "ISO-8859-15", 1<<LATIN },
+	{ "UTF-8", "GBK", 1<<ASCII | 1<<CJK },
+	{ "GBK", "UTF-8", 1<<CJK },
+	{ "BIG5", "UTF-8", 1<<CJK },
+	{ "UTF-8", "EUC-KR", 1<<ASCII | 1<<CJK },
+	{ "EUC-KR", "UTF-8", 1<<CJK },
+	{ "SHIFT_JIS", "UTF-8", 1<<CJK },
+	{ "EUC-JP", "UTF-16LE", 1<<CJK },
+};
+
+/* Rows of the double-byte charsets in which every code is assigned:
+ * GB2312 hanzi, the two levels of Big5 hanzi and KS X 1001 hangul,
+ * each as two ranges of lead and trail bytes. */
+static const struct dbcs {
+	const char *cs;
+	unsigned char lead[2][2], trail[2][2];
+} dbcs[] = {
+	{ "GBK", {{ 0xb0, 0xd6 }, { 0xd8, 0xf7 }}, {{ 0xa1, 0xfe }, { 0xa1, 0xfe }} },
+	{ "BIG5", {{ 0xa4, 0xc5 }, { 0xc9, 0xf8 }}, {{ 0x40, 0x7e }, { 0xa1, 0xfe }} },
+	{ "EUC-KR", {{ 0xb0, 0xc8 }, { 0xb0, 0xc8 }}, {{ 0xa1, 0xfe }, { 0xa1, 0xfe }} },
+};
+
+static const char *util = "iconv", *ldso, *tmpdir;
+static size_t size = (size_t)16<<20;
+static int runs = 3;
+
+static unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (seed >> 33) % n;
+}
+
+static size_t put8(char *d, unsigned c)
+{
+	if (c < 0x80) {
+		*d = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		d[0] = 0xc0 | c>>6;
+		d[1] = 0x80 | (c&0x3f);
+		return 2;
+	}
+	if (c < 0x10000) {
+		d[0] = 0xe0 | c>>12;
+		d[1] = 0x80 | (c>>6&0x3f);
+		d[2] = 0x80 | (c&0x3f);
+		return 3;
+	}
+	d[0] = 0xf0 | c>>18;
+	d[1] = 0x80 | (c>>12&0x3f);
+	d[2] = 0x80 | (c>>6&0x3f);
+	d[3] = 0x80 | (c&0x3f);
+	return 4;
+}
+
+static const struct dbcs *dbcsof(const char *cs)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof dbcs / sizeof *dbcs; i++)
+		if (!strcmp(dbcs[i].cs, cs)) return &dbcs[i];
+	return 0;
+}
+
+static unsigned pick(const unsigned char r[2][2])
+{
+	unsigned a = r[0][1] - r[0][0] + 1, b = r[1][1] - r[1][0] + 1;
+	unsigned x = rnd(a + b);
+
+	return x < a ? r[0][0] + x : r[1][0] + x - a;
+}
+
+/* Text of words and lines, with the share of non-ASCII letters and
+ * the range they come from depending on the corpus. CJK text is in
+ * UTF-8, or with d in that double-byte charset. */
+static char *corpus(int type, const struct dbcs *d, size_t *len)
+{
+	static const unsigned char junk[] = { 0xff, 0xfe, 0xc0, 0x80, 0xbf, 0xed };
+	char *s = malloc(size + 8);
+	size_t n = 0;
+	unsigned c, w = 0;
+
+	if (!s) {
+		perror("iconv-bench");
+		exit(1);
+	}
+	seed = 0x9e3779b97f4a7c15ULL + type;
+	while (n < size) {
+		if (w && !rnd(6)) {
+			s[n++] = rnd(8) ? ' ' : '\n';
+			w = 0;
+			continue;
+		}
+		w++;
+		c = 'a' + rnd(26);
+		switch (type) {
+		case LATIN:
+			if (!rnd(6)) c = 0xc0 + rnd(64);
+			break;
+		case CJK:
+			if (rnd(10) && d) {
+				s[n++] = pick(d->lead);
+				s[n++] = pick(d->trail);
+				continue;
+			}
+			if (rnd(10)) c = 0x4e00 + rnd(0x51a6);
+			break;
+		case EMOJI:
+			if (!rnd(4)) c = 0x1f300 + rnd(0x350);
+			break;
+		case DIRTY:
+			if (!rnd(6)) c = 0xc0 + rnd(64);
+			if (!rnd(100)) {
+				s[n++] = junk[rnd(sizeof junk)];
+				continue;
+			}
+			break;
+		}
+		n += put8(s+n, c);
+	}
+	*len = n;
+	return s;
+}
+
+/* The corpus in charset to: whatever cannot be converted is left out,
+ * a byte at a time, which for UTF-8 input skips a whole character. */
+static char *encode(const char *u, size_t n, const char *to, const char *from, size_t *len)
+{
+	iconv_t cd = iconv_open(to, from);
+	size_t inb = n, outb = 4*n + 16;
+	char *in = (char *)u, *d = malloc(outb), *out = d;
+
+	if (cd == (iconv_t)-1 || !d) {
+		free(d);
+		return 0;
+	}
+	while (iconv(cd, &in, &inb, &out, &outb) == (size_t)-1 && inb) {
+		if (errno != EILSEQ) break;
+		do in++, inb--;
+		while (inb && (*in & 0xc0) == 0x80);
+	}
+	iconv_close(cd);
+	*len = out - d;
+	return d;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double rawrate(const struct pair *p, const char *s, size_t n)
+{
+	static char buf[1<<20];
+	double best = 0, t;
+	char *in, *out;
+	size_t inb, outb;
+	iconv_t cd;
+	int i;
+
+	if ((cd = iconv_open(p->to, p->from)) == (iconv_t)-1) return -1;
+	for (i = 0; i < runs; i++) {
+		in = (char *)s;
+		inb = n;
+		t = now();
+		while (inb) {
+			out = buf;
+			outb = sizeof buf;
+			if (iconv(cd, &in, &inb, &out, &outb) != (size_t)-1)
+				continue;
+			if (errno == EILSEQ) in++, inb--;
+			else if (errno != E2BIG) break;
+		}
+		iconv(cd, 0, 0, 0, 0);
+		t = now() - t;
+		if (!best || t < best) best = t;
+	}
+	iconv_close(cd);
+	return n / best / 1e6;
+}
+
+static double utilrate(const struct pair *p, const char *s, size_t n)
+{
+	char path[4096];
+	double best = 0, t;
+	int fd, i, st;
+	pid_t pid;
+
+	snprintf(path, sizeof path, "%s/iconv-bench.%d", tmpdir, (int)getpid());
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0
+	 || write(fd, s, n) != (ssize_t)n || close(fd))
+		return -1;
+	for (i = 0; i < runs; i++) {
+		t = now();
+		if (!(pid = fork())) {
+			fd = open("/dev/null", O_WRONLY);
+			dup2(fd, 1);
+			dup2(fd, 2);
+			if (ldso)
+				execl(ldso, ldso, util, "-c", "-f", p->from,
+					"-t", p->to, path, (char *)0);
+			else
+				execlp(util, util, "-c", "-f", p->from,
+					"-t", p->to, path, (char *)0);
+			_exit(127);
+		}
+		if (pid < 0 || waitpid(pid, &st, 0) < 0
+		 || !WIFEXITED(st) || WEXITSTATUS(st) == 127) {
+			unlink(path);
+			return -1;
+		}
+		t = now() - t;
+		if (!best || t < best) best = t;
+	}
+	unlink(path);
+	return n / best / 1e6;
+}
+
+struct result {
+	char from[32], to[32], corpus[16];
+	double raw, util;
+};
+
+static struct result *base;
+static size_t nbase;
+
+static void loadbase(const char *name)
+{
+	FILE *f = fopen(name, "r");
+	struct result r;
+
+	if (!f) {
+		fprintf(stderr, "iconv-bench: %s: ", name);
+		perror("");
+		exit(1);
+	}
+	while (fscanf(f, "%31s %31s %15s %lf %lf", r.from, r.to, r.corpus,
+		&r.raw, &r.util) == 5) {
+		if (!(base = realloc(base, (nbase+1) * sizeof *base))) {
+			perror("iconv-bench");
+			exit(1);
+		}
+		base[nbase++] = r;
+	}
+	fclose(f);
+}
+
+static const struct result *lookup(const struct result *r)
+{
+	size_t i;
+
+	for (i = 0; i < nbase; i++)
+		if (!strcmp(base[i].from, r->from) && !strcmp(base[i].to, r->to)
+		 && !strcmp(base[i].corpus, r->corpus))
+			return &base[i];
+	return 0;
+}
+
+/* The change from b to r in percent, flagged if beyond the tolerance. */
+static int delta(double r, double b, double tol)
+{
+	double d;
+
+	if (r < 0 || b <= 0) {
+		printf(" %9s", "-");
+		return 0;
+	}
+	d = (r - b) / b * 100;
+	printf(" %+8.1f%%%s", d, d < -tol ? "!" : " ");
+	return d < -tol;
+}
+
+int main(int argc, char **argv)
+{
+	char *u8[NCORPUS] = { 0 }, *s, *t;
+	size_t n8[NCORPUS], n, i;
+	const struct result *b;
+	const struct dbcs *d;
+	struct result r;
+	double tol = 10;
+	FILE *w = 0;
+	int c, k, slow = 0;
+
+	while ((c = getopt(argc, argv, "u:l:s:r:w:b:t:")) != -1) switch (c) {
+	case 'u': util = optarg; break;
+	case 'l': ldso = optarg; break;
+	case 's': size = strtoul(optarg, 0, 10) << 20; break;
+	case 'r': runs = atoi(optarg); break;
+	case 't': tol = atof(optarg); break;
+	case 'b': loadbase(optarg); break;
+	case 'w':
+		if (!(w = fopen(optarg, "w"))) {
+			fprintf(stderr, "iconv-bench: %s: ", optarg);
+			perror("");
+			return 1;
+		}
+		break;
+	default:
+		return 1;
+	}
+	if (!size || runs < 1) {
+		fprintf(stderr, "iconv-bench: invalid size or run count\n");
+		return 1;
+	}
+	if (!(tmpdir = getenv("TMPDIR"))) tmpdir = "/tmp";
+
+	printf("%-10s %-11s %-6s %10s %10s%s\n", "from", "to", "corpus",
+		"libc MB/s", "util MB/s", nbase ? "  libc vs base  util vs base" : "");
+	for (i = 0; i < sizeof pairs / sizeof *pairs; i++) {
+		for (k = 0; k < NCORPUS; k++) {
+			if (!(pairs[i].corpora & 1<<k)) continue;
+			if (!u8[k]) u8[k] = corpus(k, 0, &n8[k]);
+			if (k == CJK && (d = dbcsof(pairs[i].from))) {
+				s = corpus(k, d, &n);
+			} else if (k == CJK && (d = dbcsof(pairs[i].to))) {
+				t = corpus(k, d, &n);
+				s = encode(t, n, pairs[i].from, d->cs, &n);
+				free(t);
+			} else if (!strcmp(pairs[i].from, "UTF-8")) {
+				s = u8[k];
+				n = n8[k];
+			} else {
+				s = encode(u8[k], n8[k], pairs[i].from, "UTF-8", &n);
+			}
+			if (!s) {
+				printf("%-10s %-11s %-6s unsupported\n",
+					pairs[i].from, pairs[i].to, cname[k]);
+				continue;
+			}
+			snprintf(r.from, sizeof r.from, "%s", pairs[i].from);
+			snprintf(r.to, sizeof r.to, "%s", pairs[i].to);
+			snprintf(r.corpus, sizeof r.corpus, "%s", cname[k]);
+			r.raw = rawrate(&pairs[i], s, n);
+			r.util = utilrate(&pairs[i], s, n);
+			printf("%-10s %-11s %-6s %10.1f %10.1f", r.from, r.to,
+				r.corpus, r.raw, r.util);
+			if ((b = lookup(&r))) {
+				slow += delta(r.raw, b->raw, tol);
+				slow += delta(r.util, b->util, tol);
+			}
+			putchar('\n');
+			fflush(stdout);
+			if (w) fprintf(w, "%s %s %s %.1f %.1f\n", r.from, r.to,
+				r.corpus, r.raw, r.util);
+			if (s != u8[k]) free(s);
+		}
+	}
+	if (slow)
+		printf("%d results more than %g%% slower than the baseline\n",
+			slow, tol);
+	if (w && fclose(w)) {
+		perror("iconv-bench");
+		return 1;
+	}
+	return 0;
+}
@@ -5,6 +5,7 @@
  * Licensed under the terms of the GNU General Public License, v2 or later
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <iconv.h>
@@ -12,32 +13,1883 @@
 #include <langinfo.h>
 #include <unistd.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <time.h>
+#include <search.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-int main(int argc, char **argv)
+/* Encodings for which the utility carries its own transcoders. They are
+ * used for the valid parts of the input; anything else (invalid or
+ * truncated sequences, lack of output space) is left to iconv(). */
+enum { UTF_8 = 1, UTF_16LE, UTF_16BE, UTF_32LE, UTF_32BE };
+
+static const unsigned char usize[] = {
+	[UTF_8] = 1, [UTF_16LE] = 2, [UTF_16BE] = 2, [UTF_32LE] = 4, [UTF_32BE] = 4
+};
+
+struct conv {
+	iconv_t cd;
+	int from, to, ascii;
+	struct conv *dec;
+	uint16_t **rev;
+};
+
+/* Charset names compare like in libc: ignoring case and anything
+ * that is not a letter or a digit. */
+static int normname(char *n, size_t len, const char *name)
+{
+	size_t i = 0;
+
+	for (; *name; name++) {
+		if (!isalnum((unsigned char)*name)) continue;
+		if (i == len - 1) return 0;
+		n[i++] = tolower((unsigned char)*name);
+	}
+	n[i] = 0;
+	return 1;
+}
+
+static int utype(const char *name)
+{
+	static const char names[][8] = {
+		[UTF_8] = "utf8", [UTF_16LE] = "utf16le", [UTF_16BE] = "utf16be",
+		[UTF_32LE] = "utf32le", [UTF_32BE] = "utf32be",
+	};
+	char n[8];
+	int t;
+
+	if (!normname(n, sizeof n, name)) return 0;
+	for (t = UTF_8; t <= UTF_32BE; t++)
+		if (!strcmp(n, names[t])) return t;
+	return 0;
+}
+
+static inline unsigned get16(const unsigned char *s, int be)
+{
+	return be ? s[0]<<8 | s[1] : s[1]<<8 | s[0];
+}
+
+static inline unsigned get32(const unsigned char *s, int be)
+{
+	return be ? (unsigned)s[0]<<24 | s[1]<<16 | s[2]<<8 | s[3]
+		: (unsigned)s[3]<<24 | s[2]<<16 | s[1]<<8 | s[0];
+}
+
+static inline void put16(unsigned char *d, unsigned c, int be)
+{
+	d[!be] = c>>8;
+	d[be] = c;
+}
+
+static inline void put32(unsigned char *d, unsigned c, int be)
+{
+	d[be?0:3] = c>>24;
+	d[be?1:2] = c>>16;
+	d[be?2:1] = c>>8;
+	d[be?3:0] = c;
+}
+
+/* Decode one character, returning its length, or 0 if it is invalid
+ * or incomplete; only Unicode scalar values are accepted. */
+static inline size_t udec(int t, const unsigned char *s, size_t n, unsigned *wc)
+{
+	unsigned c, d;
+
+	switch (t) {
+	case UTF_8:
+		c = *s;
+		if (c < 0x80) {
+			*wc = c;
+			return 1;
+		}
+		if (c < 0xc2 || c > 0xf4 || n < 2 || (s[1]&0xc0) != 0x80)
+			return 0;
+		if (c < 0xe0) {
+			*wc = (c&0x1f)<<6 | (s[1]&0x3f);
+			return 2;
+		}
+		if (n < 3 || (s[2]&0xc0) != 0x80)
+			return 0;
+		if (c < 0xf0) {
+			c = (c&0x0f)<<12 | (s[1]&0x3f)<<6 | (s[2]&0x3f);
+			if (c < 0x800 || c-0xd800 < 0x800) return 0;
+			*wc = c;
+			return 3;
+		}
+		if (n < 4 || (s[3]&0xc0) != 0x80)
+			return 0;
+		c = (c&0x07)<<18 | (s[1]&0x3f)<<12 | (s[2]&0x3f)<<6 | (s[3]&0x3f);
+		if (c < 0x10000 || c > 0x10ffff) return 0;
+		*wc = c;
+		return 4;
+	case UTF_16LE:
+	case UTF_16BE:
+		if (n < 2) return 0;
+		c = get16(s, t==UTF_16BE);
+		if (c-0xd800 >= 0x800) {
+			*wc = c;
+			return 2;
+		}
+		if (c >= 0xdc00 || n < 4) return 0;
+		d = get16(s+2, t==UTF_16BE);
+		if (d-0xdc00 >= 0x400) return 0;
+		*wc = 0x10000 + ((c-0xd800)<<10) + (d-0xdc00);
+		return 4;
+	case UTF_32LE:
+	case UTF_32BE:
+		if (n < 4) return 0;
+		c = get32(s, t==UTF_32BE);
+		if (c > 0x10ffff || c-0xd800 < 0x800) return 0;
+		*wc = c;
+		return 4;
+	}
+	return 0;
+}
+
+/* Encode a scalar value, returning its length, or 0 if it does not fit. */
+static inline size_t uenc(int t, unsigned char *d, size_t n, unsigned c)
+{
+	switch (t) {
+	case UTF_8:
+		if (c < 0x80) {
+			if (n < 1) return 0;
+			*d = c;
+			return 1;
+		}
+		if (c < 0x800) {
+			if (n < 2) return 0;
+			d[0] = 0xc0 | c>>6;
+			d[1] = 0x80 | (c&0x3f);
+			return 2;
+		}
+		if (c < 0x10000) {
+			if (n < 3) return 0;
+			d[0] = 0xe0 | c>>12;
+			d[1] = 0x80 | (c>>6&0x3f);
+			d[2] = 0x80 | (c&0x3f);
+			return 3;
+		}
+		if (n < 4) return 0;
+		d[0] = 0xf0 | c>>18;
+		d[1] = 0x80 | (c>>12&0x3f);
+		d[2] = 0x80 | (c>>6&0x3f);
+		d[3] = 0x80 | (c&0x3f);
+		return 4;
+	case UTF_16LE:
+	case UTF_16BE:
+		if (c < 0x10000) {
+			if (n < 2) return 0;
+			put16(d, c, t==UTF_16BE);
+			return 2;
+		}
+		if (n < 4) return 0;
+		c -= 0x10000;
+		put16(d, 0xd800 | c>>10, t==UTF_16BE);
+		put16(d+2, 0xdc00 | (c&0x3ff), t==UTF_16BE);
+		return 4;
+	case UTF_32LE:
+	case UTF_32BE:
+		if (n < 4) return 0;
+		put32(d, c, t==UTF_32BE);
+		return 4;
+	}
+	return 0;
+}
+
+/* Copy a run of ASCII characters in whole blocks, returning the number
+ * of input bytes consumed. Pairs without a block routine return 0 and
+ * are handled one character at a time. */
+static size_t uascii(int from, int to, const unsigned char *s, size_t n,
+	unsigned char *d, size_t m)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i z = _mm_setzero_si128();
+	__m128i v, w;
+
+	switch (from<<4 | to) {
+	case UTF_8<<4 | UTF_8:
+		for (; n-i >= 16 && m-i >= 16; i += 16) {
+			v = _mm_loadu_si128((const void *)(s+i));
+			if (_mm_movemask_epi8(v)) break;
+			_mm_storeu_si128((void *)(d+i), v);
+		}
+		break;
+	case UTF_8<<4 | UTF_16LE:
+		for (; n-i >= 16 && m-2*i >= 32; i += 16) {
+			v = _mm_loadu_si128((const void *)(s+i));
+			if (_mm_movemask_epi8(v)) break;
+			_mm_storeu_si128((void *)(d+2*i), _mm_unpacklo_epi8(v, z));
+			_mm_storeu_si128((void *)(d+2*i+16), _mm_unpackhi_epi8(v, z));
+		}
+		break;
+	case UTF_16LE<<4 | UTF_8:
+		for (; n-i >= 16 && m-i/2 >= 8; i += 16) {
+			v = _mm_loadu_si128((const void *)(s+i));
+			w = _mm_and_si128(v, _mm_set1_epi16(-128));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(w, z)) != 0xffff)
+				break;
+			_mm_storel_epi64((void *)(d+i/2), _mm_packus_epi16(v, v));
+		}
+		break;
+	}
+#else
+	uint64_t x;
+	size_t j;
+
+	if (from != UTF_8) return 0;
+	for (; n-i >= 8 && m-i*usize[to] >= 8*usize[to]; i += 8) {
+		memcpy(&x, s+i, 8);
+		if (x & 0x8080808080808080ULL) break;
+		if (to == UTF_8) {
+			memcpy(d+i, s+i, 8);
+		} else for (j = 0; j < 8; j++) {
+			uenc(to, d+(i+j)*usize[to], usize[to], s[i+j]);
+		}
+	}
+#endif
+	return i;
+}
+
+/* Copy the run of ASCII bytes at the start of the input, for pairs of
+ * ASCII-compatible charsets. */
+static void acopy(char **in, size_t *inb, char **out, size_t *outb)
+{
+	const unsigned char *s = (void *)*in;
+	unsigned char *d = (void *)*out;
+	size_t n = *inb < *outb ? *inb : *outb, i;
+
+	i = uascii(UTF_8, UTF_8, s, n, d, n);
+	for (; i < n && s[i] < 0x80; i++) d[i] = s[i];
+	*in += i, *inb -= i;
+	*out += i, *outb -= i;
+}
+
+/* Length of the run of ASCII bytes at s. */
+static size_t alen(const unsigned char *s, size_t n)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i v;
+
+	for (; n-i >= 32; i += 32) {
+		v = _mm_or_si128(_mm_loadu_si128((const void *)(s+i)),
+			_mm_loadu_si128((const void *)(s+i+16)));
+		if (_mm_movemask_epi8(v)) break;
+	}
+#else
+	uint64_t x, y;
+
+	for (; n-i >= 16; i += 16) {
+		memcpy(&x, s+i, 8);
+		memcpy(&y, s+i+8, 8);
+		if ((x|y) & 0x8080808080808080ULL) break;
+	}
+#endif
+	for (; i < n && s[i] < 0x80; i++);
+	return i;
+}
+
+/* Length of the valid UTF-8 at s, in whole characters. Bytes are run
+ * through a DFA over the byte classes of Unicode's table of well-formed
+ * sequences, which rejects overlong forms, surrogates and code points
+ * past U+10FFFF like the decoder does. It is laid out as a shift DFA:
+ * each state is a bit offset into the row of the byte's class, so that
+ * the chain from one byte to the next is a shift and a mask, and there
+ * is no branch on the length of each character. */
+#define R(a,b,c,d,e,f,g,h) ((uint64_t)(a)*6 | (uint64_t)(b)*6<<6 \
+	| (uint64_t)(c)*6<<12 | (uint64_t)(d)*6<<18 | (uint64_t)(e)*6<<24 \
+	| (uint64_t)(f)*6<<30 | (uint64_t)(g)*6<<36 | (uint64_t)(h)*6<<42 \
+	| (uint64_t)8*6<<48)
+
+static size_t uvalid(const unsigned char *s, size_t n)
+{
+	/* states: 0 between characters, 1-3 that many continuation bytes
+	 * to go, 4-7 the restricted second byte after E0 ED F0 F4, 8 error */
+	static const uint64_t row[12] = {
+		R(0, 8, 8, 8, 8, 8, 8, 8),	/* 00-7F */
+		R(8, 0, 1, 2, 8, 1, 8, 2),	/* 80-8F */
+		R(8, 0, 1, 2, 8, 1, 2, 8),	/* 90-9F */
+		R(8, 0, 1, 2, 1, 8, 2, 8),	/* A0-BF */
+		R(8, 8, 8, 8, 8, 8, 8, 8),	/* C0 C1 F5-FF */
+		R(1, 8, 8, 8, 8, 8, 8, 8),	/* C2-DF */
+		R(4, 8, 8, 8, 8, 8, 8, 8),	/* E0 */
+		R(2, 8, 8, 8, 8, 8, 8, 8),	/* E1-EC EE EF */
+		R(5, 8, 8, 8, 8, 8, 8, 8),	/* ED */
+		R(6, 8, 8, 8, 8, 8, 8, 8),	/* F0 */
+		R(3, 8, 8, 8, 8, 8, 8, 8),	/* F1-F3 */
+		R(7, 8, 8, 8, 8, 8, 8, 8),	/* F4 */
+	};
+	static const unsigned char cls[256] = {
+		[0x80 ... 0x8f] = 1, [0x90 ... 0x9f] = 2, [0xa0 ... 0xbf] = 3,
+		[0xc0 ... 0xc1] = 4, [0xc2 ... 0xdf] = 5, [0xe0] = 6,
+		[0xe1 ... 0xec] = 7, [0xed] = 8, [0xee ... 0xef] = 7,
+		[0xf0] = 9, [0xf1 ... 0xf3] = 10, [0xf4] = 11, [0xf5 ... 0xff] = 4,
+	};
+	size_t i = 0, j, end = 0;
+	unsigned st = 0;
+
+	while (i < n && st != 8*6) {
+		if (!st && (j = alen(s+i, n-i)) >= 16) {
+			i += j;
+			end = i;
+			continue;
+		}
+		for (j = i + (n-i < 64 ? n-i : 64); i < j; i++) {
+			st = row[cls[s[i]]] >> st & 63;
+			end = st ? end : i+1;
+		}
+	}
+	return end;
+}
+#undef R
+
+/* Transcode the longest valid prefix of the input that fits. */
+static inline __attribute__((always_inline))
+void ufast_t(int from, int to, char **in, size_t *inb, char **out, size_t *outb)
+{
+	const unsigned char *s = (void *)*in;
+	unsigned char *d = (void *)*out;
+	size_t n = *inb, m = *outb, k, l;
+	unsigned c, run = 8;
+
+	while (n) {
+		/* only look for blocks once a few ASCII characters in a row
+		 * suggest there will be one, mixed text gains nothing */
+		if (run >= 8 && (k = uascii(from, to, s, n, d, m))) {
+			l = k / usize[from] * usize[to];
+			s += k, n -= k;
+			d += l, m -= l;
+			if (!n) break;
+		}
+		if (!(k = udec(from, s, n, &c)) || !(l = uenc(to, d, m, c)))
+			break;
+		run = c < 0x80 ? run+1 : 0;
+		s += k, n -= k;
+		d += l, m -= l;
+	}
+	*in = (char *)s;
+	*inb = n;
+	*out = (char *)d;
+	*outb = m;
+}
+
+/* Instantiate the transcoder for each pair, so that the per-character
+ * paths are specialized by the compiler. */
+static void ufast(int from, int to, char **in, size_t *inb, char **out, size_t *outb)
+{
+#define P(a, b) case a<<4 | b: ufast_t(a, b, in, inb, out, outb); break;
+#define T(a) P(a, UTF_8) P(a, UTF_16LE) P(a, UTF_16BE) P(a, UTF_32LE) P(a, UTF_32BE)
+	switch (from<<4 | to) {
+	T(UTF_8) T(UTF_16LE) T(UTF_16BE) T(UTF_32LE) T(UTF_32BE)
+	}
+#undef T
+#undef P
+}
+
+/* Same contract as iconv(). When the utility has its own transcoder it
+ * does the bulk of the work; iconv() is only asked to get past whatever
+ * stopped it, a few output bytes at a time, so that errors are reported
+ * exactly as libc would report them. */
+static size_t revconv(struct conv *, char **, size_t *, char **, size_t *);
+static size_t aconv(struct conv *, char **, size_t *, char **, size_t *);
+
+static size_t conv(struct conv *c, char **in, size_t *inb, char **out, size_t *outb)
+{
+	size_t r, lim, rem;
+
+	if (c->ascii)
+		return aconv(c, in, inb, out, outb);
+	if (c->rev)
+		return revconv(c, in, inb, out, outb);
+	if (!c->from || !c->to)
+		return iconv(c->cd, in, inb, out, outb);
+	for (;;) {
+		ufast(c->from, c->to, in, inb, out, outb);
+		if (!*inb) return 0;
+		lim = rem = *outb < 32 ? *outb : 32;
+		r = iconv(c->cd, in, inb, out, &rem);
+		*outb -= lim - rem;
+		if (r != (size_t)-1) return r;
+		if (errno != E2BIG || rem == *outb) return -1;
+	}
+}
+
+/* Offset of the first run of at least 32 ASCII bytes, or n. */
+static size_t aspan(const unsigned char *s, size_t n)
+{
+	uint64_t x;
+	size_t i, run = 0;
+
+	for (i = 0; n-i >= 8; i += 8) {
+		memcpy(&x, s+i, 8);
+		if (x & 0x8080808080808080ULL) run = 0;
+		else if ((run += 8) == 32) return i-24;
+	}
+	return n;
+}
+
+/* Between two ASCII-compatible charsets, ASCII runs are copied and
+ * iconv() gets the text in between, up to and including the first byte
+ * of the next long run: a character straddling that byte has to end on
+ * it, since the byte after it is ASCII too. Short runs are left in the
+ * text given to iconv(), whose cost per call would otherwise dominate
+ * on text with a few non-ASCII characters on every line. The search for
+ * the next run is bounded, starting small since an invalid sequence
+ * ends the call, so that text without any is still converted in linear
+ * time. */
+#define ASPAN 65536
+
+static size_t aconv(struct conv *c, char **in, size_t *inb, char **out, size_t *outb)
+{
+	size_t r, n, k, lim = 64;
+
+	for (;;) {
+		acopy(in, inb, out, outb);
+		if (!*inb) return 0;
+		n = aspan((unsigned char *)*in, *inb < lim ? *inb : lim) + 1;
+		if (n > lim && lim < ASPAN) lim *= 2;
+		if (n > *inb) n = *inb;
+		k = n;
+		r = c->rev ? revconv(c, in, &k, out, outb)
+			: iconv(c->cd, in, &k, out, outb);
+		*inb -= n - k;
+		if (r != (size_t)-1) continue;
+		/* a character cut short by a limit that did not come from
+		 * an ASCII run is complete in the next step */
+		if (errno != EINVAL || n == *inb + (n-k)) return -1;
+		if (k == n) return c->rev ? revconv(c, in, inb, out, outb)
+			: iconv(c->cd, in, inb, out, outb);
+	}
+}
+
+/* libc can decode, but not encode, the double-byte CJK charsets below.
+ * For those the utility decodes to UTF-32 and encodes through a reverse
+ * table, built once per charset by running every one- and two-byte code
+ * through the libc decoder. Where several codes decode to the same
+ * character the lowest one wins, except for the two Big5 radicals that
+ * duplicate regular hanzi, which conventionally encode to the latter.
+ *
+ * libc decodes all the Korean names with one CP949 map and all the Big5
+ * names with one HKSCS map, so the table for a narrower name keeps only
+ * the codes in its own repertoire: both bytes from 0xa1 for KS X 1001,
+ * the symbols and two levels of hanzi for Big5, to which CP950 adds the
+ * euro sign and the box drawing at the end. The type returned below
+ * selects that repertoire. */
+enum { REV_ALL = 1, REV_KSX, REV_BIG5, REV_CP950 };
+
+static int revtype(const char *name)
+{
+	static const struct { char name[10]; unsigned char type; } names[] = {
+		{ "gbk", REV_ALL }, { "cp936", REV_ALL }, { "gb2312", REV_ALL },
+		{ "big5", REV_BIG5 }, { "bigfive", REV_BIG5 },
+		{ "cp950", REV_CP950 }, { "big5hkscs", REV_ALL },
+		{ "euckr", REV_KSX }, { "ksc5601", REV_KSX },
+		{ "ksx1001", REV_KSX }, { "cp949", REV_ALL },
+	};
+	char n[10];
+	size_t i;
+
+	if (!normname(n, sizeof n, name)) return 0;
+	for (i = 0; i < sizeof names / sizeof *names; i++)
+		if (!strcmp(n, names[i].name)) return names[i].type;
+	return 0;
+}
+
+static int revcode(int type, unsigned i)
+{
+	switch (type) {
+	case REV_KSX:
+		return i >> 8 >= 0xa1 && (i & 0xff) >= 0xa1;
+	case REV_CP950:
+		if (i == 0xa3e1 || (i >= 0xf9d6 && i <= 0xf9fe)) return 1;
+		/* fall through */
+	case REV_BIG5:
+		return (i >= 0xa140 && i <= 0xa3bf) || (i >= 0xa440 && i <= 0xc67e)
+			|| (i >= 0xc940 && i <= 0xf9d5);
+	}
+	return 1;
+}
+
+static uint16_t **revtab(const char *name)
+{
+	static char cname[32];
+	static uint16_t **cache;
+	uint16_t **rev;
+	unsigned char s[2], w[8];
+	char *in, *out;
+	size_t inb, outb;
+	unsigned i, c;
+	int type = revtype(name);
+	iconv_t cd;
+
+	if (cache && !strcmp(cname, name)) return cache;
+	cd = iconv_open("UTF-32LE", name);
+	if (cd == (iconv_t)-1) return 0;
+	if (!(rev = calloc(0x1100, sizeof *rev))) goto fail;
+	for (i = 0x80; i < 0x10000; i++) {
+		if (i > 0xff && (i>>8 < 0x81 || i>>8 == 0xff || (i&0xff) < 0x40))
+			continue;
+		if (!revcode(type, i)) continue;
+		s[0] = i > 0xff ? i>>8 : i;
+		s[1] = i;
+		in = (char *)s;
+		inb = i > 0xff ? 2 : 1;
+		out = (char *)w;
+		outb = sizeof w;
+		if (iconv(cd, &in, &inb, &out, &outb) == (size_t)-1
+		 || out != (char *)w + 4)
+			continue;
+		c = get32(w, 0);
+		if (c < 0x80 || c > 0x10ffff) continue;
+		if (!rev[c>>8] && !(rev[c>>8] = calloc(256, sizeof **rev)))
+			goto fail;
+		if (!rev[c>>8][c&0xff] || rev[c>>8][c&0xff] == 0xa2cc
+		 || rev[c>>8][c&0xff] == 0xa2ce)
+			rev[c>>8][c&0xff] = i;
+	}
+	iconv_close(cd);
+	if (strlen(name) < sizeof cname) {
+		strcpy(cname, name);
+		cache = rev;
+	}
+	return rev;
+fail:
+	iconv_close(cd);
+	if (rev) for (i = 0; i < 0x1100; i++) free(rev[i]);
+	free(rev);
+	errno = ENOMEM;
+	return 0;
+}
+
+/* Characters without a code are replaced by '*', as libc's own
+ * encoders do. */
+static size_t revconv(struct conv *c, char **in, size_t *inb, char **out, size_t *outb)
+{
+	unsigned char w[4096], *p;
+	char *wp;
+	size_t r, wl;
+	unsigned u, v;
+	int e;
+
+	for (;;) {
+		if (*outb < 2) {
+			errno = E2BIG;
+			return -1;
+		}
+		wp = (char *)w;
+		wl = *outb/2*4 < sizeof w ? *outb/2*4 : sizeof w;
+		r = conv(c->dec, in, inb, &wp, &wl);
+		e = errno;
+		for (p = w; p < (unsigned char *)wp; p += 4) {
+			u = get32(p, 0);
+			v = u < 0x80 ? u : u < 0x110000 && c->rev[u>>8]
+				? c->rev[u>>8][u&0xff] : 0;
+			if (!v && u) v = '*';
+			if (v > 0xff) {
+				*(*out)++ = v>>8;
+				--*outb;
+			}
+			*(*out)++ = v;
+			--*outb;
+		}
+		if (r != (size_t)-1) return r;
+		if (e != E2BIG) break;
+	}
+	errno = e;
+	return -1;
+}
+
+/* Whether output can be started afresh at any point: a character
+ * outside ASCII must not leave a shift state to undo, and "AA" must come
+ * out as twice "A" (no byte order mark). With ascii set, ASCII must also
+ * come out unchanged. The table encoders above qualify by construction. */
+static int plaintarget(const char *to, int ascii)
+{
+	unsigned char w[4*129], b[256];
+	char *in, *out;
+	size_t inb, outb, n, i;
+	iconv_t cd;
+	int r;
+
+	if ((cd = iconv_open(to, "UTF-32LE")) == (iconv_t)-1)
+		return errno == EINVAL && revtype(to);
+	n = ascii ? 128 : 2;
+	for (i = 0; i < n; i++) put32(w+4*i, ascii ? i : 'A', 0);
+	put32(w+4*n, 0x3042, 0);
+	in = (char *)w;
+	inb = 4*n;
+	out = (char *)b;
+	outb = sizeof b;
+	r = iconv(cd, &in, &inb, &out, &outb) != (size_t)-1;
+	n = out - (char *)b;
+	if (r && ascii)
+		for (r = n == 128, i = 0; r && i < n; i++) r = b[i] == i;
+	else if (r)
+		r = n%2 == 0 && !memcmp(b, b+n/2, n/2);
+	inb = 4;
+	out = (char *)b;
+	outb = sizeof b;
+	if (r && iconv(cd, &in, &inb, &out, &outb) != (size_t)-1) {
+		out = (char *)b;
+		r = iconv(cd, 0, 0, &out, &outb) != (size_t)-1 && out == (char *)b;
+	}
+	iconv_close(cd);
+	return r;
+}
+
+/* Whether bytes below 0x80 stand for themselves in the source, at least
+ * where a character starts; being a plain target as well rules out the
+ * charsets that shift in band, which would decode the ASCII probe. */
+static int asciisource(const char *from)
+{
+	unsigned char s[128], w[4*128];
+	char *in = (char *)s, *out = (char *)w;
+	size_t inb = sizeof s, outb = sizeof w, i;
+	iconv_t cd;
+	int r;
+
+	if ((cd = iconv_open("UTF-32LE", from)) == (iconv_t)-1)
+		return 0;
+	for (i = 0; i < 128; i++) s[i] = i;
+	r = iconv(cd, &in, &inb, &out, &outb) != (size_t)-1 && !outb;
+	for (i = 0; r && i < 128; i++) r = get32(w+4*i, 0) == i;
+	iconv_close(cd);
+	return r && plaintarget(from, 1);
+}
+
+static int conv_open(struct conv *c, const char *to, const char *from)
+{
+	*c = (struct conv){ .from = utype(from), .to = utype(to) };
+	c->cd = iconv_open(to, from);
+	if (c->cd == (iconv_t)-1) {
+		if (errno != EINVAL || !revtype(to)) return -1;
+		if (!(c->rev = revtab(to))) return -1;
+		if (!(c->dec = malloc(sizeof *c->dec))) return -1;
+		if (conv_open(c->dec, "UTF-32LE", from) < 0) {
+			free(c->dec);
+			return -1;
+		}
+	}
+	if (!c->from || !c->to)
+		c->ascii = asciisource(from) && plaintarget(to, 1);
+	return 0;
+}
+
+
+static void conv_close(struct conv *c)
+{
+	if (c->cd != (iconv_t)-1) iconv_close(c->cd);
+	if (c->dec) {
+		conv_close(c->dec);
+		free(c->dec);
+	}
+}
+
+/* Regular files and pipes are read in chunks well above BUFSIZ, so that
+ * the number of syscalls does not scale with the size of the input. */
+#define IOMAX (128*1024)
+
+/* Regular files are mapped rather than read, a window at a time so that
+ * files larger than the address space can be converted too. */
+#define MAPWIN (sizeof(size_t) > 4 ? (size_t)1<<30 : (size_t)64<<20)
+
+/* Output is collected in large page-aligned buffers and written with
+ * write(2). They are not spliced into a pipe: the pipe would go on
+ * referring to pages that are then filled again, and what a reader
+ * that splices or tees them on gets would change under it. */
+#define OUTBUF ((size_t)1<<20)
+#define OUTMIN 4096
+
+/* With -p, reading, converting and writing overlap: the input is read
+ * by a thread of its own into a ring of buffers, and full output
+ * buffers are handed to another thread for writing, from a ring as
+ * well. Either side blocks only when the whole ring is waiting on the
+ * other, so that given a CPU for each, slow storage and conversion
+ * take as long as the slower of the two rather than their sum. With a
+ * single CPU the input is read as without -p: a reader thread would
+ * only contend for it with whatever feeds the input, which then falls
+ * behind. */
+#define RING 4
+
+struct ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf[RING];
+	size_t len[RING];
+	unsigned head, tail;
+	int fd, err, idle;
+};
+
+struct obuf {
+	int fd, reg;
+	char *buf;
+	size_t len;
+	struct ring *ring;
+};
+
+static const char *from, *to;
+static struct obuf ob;
+static int jobs = 1;
+
+/* When source and target are the same charset, valid input is copied
+ * as is: always for single-byte charsets in which every byte is valid,
+ * and as far as a scan finds it valid for ASCII and UTF-8. */
+enum { COPY_ANY = 1, COPY_ASCII, COPY_UTF8 };
+static int same;
+
+/* The UTF type of the source, 0 for a single-byte charset, with the
+ * bytes it has no character for set in sbad, or -1 for anything else. */
+static int stype = -1;
+static unsigned char sbad[256];
+
+/* Bytes of input that could not be converted. With -c they are left
+ * out, and reported unless -s is given as well; without it, conversion
+ * of the file stops at the first of them. Either way the exit status
+ * is 1. Each thread converting files of its own (--output-dir) counts
+ * them for the file it is on. */
+static _Thread_local size_t omitted;
+static int omit, report;
+
+static int stopped(void)
+{
+	return omitted && !omit;
+}
+
+/* Counters for --stats and --progress, only kept when one of them is
+ * given. The time of each stage is summed over the threads spent in
+ * it; for a mapped input, reading happens in the page faults taken
+ * while converting, and counts as such. */
+enum { STATS = 1, PROGRESS = 2 };
+enum { T_READ, T_CONV, T_WRITE };
+static int stats;
+static struct {
+	uint64_t in, out, invalid, omitted, t[3];
+} cnt;
+
+static uint64_t start;
+
+static uint64_t clk(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void tally(uint64_t *c, uint64_t n)
+{
+	__atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
+
+static size_t convstep(struct conv *c, char **in, size_t *inb, char **out, size_t *outb)
+{
+	uint64_t t;
+	size_t r;
+	int e;
+
+	if (!stats) return conv(c, in, inb, out, outb);
+	t = clk();
+	r = conv(c, in, inb, out, outb);
+	e = errno;
+	tally(&cnt.t[T_CONV], clk() - t);
+	errno = e;
+	return r;
+}
+
+static char *obufalloc(void)
+{
+	char *p = mmap(0, OUTBUF, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("iconv");
+		exit(1);
+	}
+	return p;
+}
+
+/* The buffer is kept when o is opened again for another file. */
+static void oopen(struct obuf *o, int fd)
+{
+	struct stat st;
+
+	o->fd = fd;
+	o->len = 0;
+	if (!o->buf) o->buf = obufalloc();
+	o->reg = !fstat(fd, &st) && S_ISREG(st.st_mode);
+}
+
+static void wfull(int fd, const char *p, size_t n)
+{
+	ssize_t k;
+	uint64_t t = stats ? clk() : 0;
+
+	if (stats) tally(&cnt.out, n);
+	while (n) {
+		k = write(fd, p, n);
+		if (k < 0) {
+			if (errno == EINTR) continue;
+			perror("iconv: write error");
+			exit(1);
+		}
+		p += k;
+		n -= k;
+	}
+	if (stats) tally(&cnt.t[T_WRITE], clk() - t);
+}
+
+static void *writer(void *p)
+{
+	struct obuf *o = p;
+	struct ring *r = o->ring;
+	unsigned i;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (r->head == r->tail)
+			pthread_cond_wait(&r->cond, &r->lock);
+		i = r->head % RING;
+		pthread_mutex_unlock(&r->lock);
+		wfull(o->fd, r->buf[i], r->len[i]);
+		pthread_mutex_lock(&r->lock);
+		r->head++;
+		pthread_cond_signal(&r->cond);
+	}
+	return 0;
+}
+
+/* Hands the current buffer to the writer and moves on to the next one
+ * in the ring once it has been written out. */
+static void opass(struct obuf *o)
+{
+	struct ring *r = o->ring;
+
+	pthread_mutex_lock(&r->lock);
+	r->len[r->tail++ % RING] = o->len;
+	pthread_cond_signal(&r->cond);
+	while (r->tail - r->head == RING)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	o->buf = r->buf[r->tail % RING];
+	o->len = 0;
+}
+
+static void odrain(struct obuf *o)
+{
+	struct ring *r = o->ring;
+
+	if (!r) return;
+	pthread_mutex_lock(&r->lock);
+	while (r->head != r->tail)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Moves o over to a writer thread, if one can be had. */
+static void ostart(struct obuf *o)
+{
+	static struct ring r = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t t;
+	int i;
+
+	for (i = 0; i < RING; i++)
+		r.buf[i] = obufalloc();
+	o->ring = &r;
+	if (pthread_create(&t, 0, writer, o)) {
+		o->ring = 0;
+		return;
+	}
+	pthread_detach(t);
+	o->buf = r.buf[0];
+}
+
+static void oflush(struct obuf *o)
+{
+	if (!o->len) return;
+	if (o->ring) {
+		opass(o);
+		return;
+	}
+	wfull(o->fd, o->buf, o->len);
+	o->len = 0;
+}
+
+static char *obegin(struct obuf *o, size_t *n)
+{
+	if (OUTBUF - o->len < OUTMIN) oflush(o);
+	*n = OUTBUF - o->len;
+	return o->buf + o->len;
+}
+
+static void oend(struct obuf *o, const char *out)
+{
+	o->len = out - o->buf;
+}
+
+static void owrite(struct obuf *o, const char *p, size_t n)
+{
+	size_t k;
+	char *d;
+
+	while (n) {
+		d = obegin(o, &k);
+		if (k > n) k = n;
+		memcpy(d, p, k);
+		oend(o, d+k);
+		p += k;
+		n -= k;
+	}
+}
+
+/* Output n bytes of the input file fd at off, which are mapped at p,
+ * letting the kernel move them where it can: copy_file_range between
+ * regular files (a reflink or server-side copy on filesystems that do
+ * that), sendfile to anything else. Should neither work for this pair
+ * of files, the mapping is written out. */
+static void ocopy(struct obuf *o, int fd, off_t off, const char *p, size_t n)
+{
+	ssize_t k;
+	uint64_t t;
+
+	oflush(o);
+	odrain(o);
+	t = stats ? clk() : 0;
+	while (n) {
+		if (o->reg)
+			k = copy_file_range(fd, &off, o->fd, 0, n, 0);
+		else
+			k = sendfile(o->fd, fd, &off, n);
+		if (k > 0) {
+			p += k;
+			n -= k;
+			if (stats) tally(&cnt.out, k);
+			continue;
+		}
+		if (k < 0 && errno == EINTR) continue;
+		if (k < 0 && errno != EINVAL && errno != ENOSYS
+		 && errno != EXDEV && errno != EOPNOTSUPP && errno != EBADF) {
+			perror("iconv: write error");
+			exit(1);
+		}
+		break;
+	}
+	if (stats) tally(&cnt.t[T_WRITE], clk() - t);
+	owrite(o, p, n);
+}
+
+static size_t iosize(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode)))
+		return BUFSIZ;
+	return st.st_blksize > 64*1024 ? IOMAX : 64*1024;
+}
+
+/* On an invalid sequence, one unit of the source charset (the length
+ * of its encoding of '0') is skipped. */
+static size_t unitsize(void)
+{
+	static size_t unitsize;
+	wchar_t wc='0';
+	char dummy[8], *dummyp=dummy;
+	iconv_t cd2;
+	int i;
+
+	if (unitsize) return unitsize;
+	cd2 = iconv_open(from, "WCHAR_T");
+	if (cd2 == (iconv_t)-1) {
+		unitsize = 1;
+	} else {
+		/* the second one, after any byte order mark */
+		for (i = 0; i < 2; i++) {
+			dummyp = dummy;
+			iconv(cd2,
+				(char *[1]){(char *)&wc},
+				(size_t[1]){sizeof wc},
+				&dummyp, (size_t[1]){sizeof dummy});
+		}
+		unitsize = dummyp-dummy;
+		if (!unitsize) unitsize=1;
+		iconv_close(cd2);
+	}
+	return unitsize;
+}
+
+/* With it goes whatever follows that cannot start a character either,
+ * where the source is known well enough to tell, so that a run of
+ * garbage is skipped in one step. That is only done while the input
+ * stays aligned on the source's code units, and the last few bytes are
+ * left alone, since the rest of a character starting there may not be
+ * read yet. */
+static size_t skip(const char *p, size_t n)
 {
-	const char *from=0, *to=0;
-	int b;
+	const unsigned char *s = (const void *)p;
+	size_t k = unitsize() < n ? unitsize() : n;
+	unsigned c;
+
+	if (stats) tally(&cnt.invalid, 1);
+	if (stype > 0 && !(k % usize[stype]))
+		while (n-k >= 4 && !udec(stype, s+k, n-k, &c))
+			k += usize[stype];
+	else if (!stype)
+		while (k < n && sbad[s[k]])
+			k++;
+	return k;
+}
+
+static void srcprobe(void)
+{
+	unsigned char b[32];
+	char *in, *out;
+	size_t inb, outb;
+	iconv_t cd;
+	int t, i;
+
+	unitsize();
+	if ((t = utype(from))) {
+		stype = t;
+		return;
+	}
+	if ((cd = iconv_open("UTF-32LE", from)) == (iconv_t)-1)
+		return;
+	for (i = 0; i < 256 && t >= 0; i++) {
+		in = (char [1]){i};
+		inb = 1;
+		out = (char *)b;
+		outb = sizeof b;
+		if (iconv(cd, &in, &inb, &out, &outb) != (size_t)-1)
+			continue;
+		if (errno == EILSEQ) sbad[i] = 1;
+		else t = -1;
+	}
+	iconv_close(cd);
+	stype = t;
+}
+
+/* Whether the conversion is a copy, and for which input (see same). */
+static int copytype(void)
+{
+	char a[16], b[16], o[8], *in, *out;
+	size_t inb, outb;
+	int t, i, ok, ascii = 1, any = 1;
 	iconv_t cd;
-	char buf[BUFSIZ];
-	char outbuf[BUFSIZ*4];
+
+	if (!normname(a, sizeof a, from) || !normname(b, sizeof b, to)
+	 || strcmp(a, b))
+		return 0;
+	if ((t = utype(from)))
+		return t == UTF_8 ? COPY_UTF8 : 0;
+	if ((cd = iconv_open(to, from)) == (iconv_t)-1)
+		return 0;
+	for (i = 0; i < 256; i++) {
+		in = (char [1]){i};
+		inb = 1;
+		out = o;
+		outb = sizeof o;
+		ok = iconv(cd, &in, &inb, &out, &outb) != (size_t)-1;
+		if (ok && (out != o+1 || *o != (char)i)) ascii = any = 0;
+		if (!ok) any = 0;
+		if (ok != (i < 0x80)) ascii = 0;
+	}
+	iconv_close(cd);
+	return any ? COPY_ANY : ascii ? COPY_ASCII : 0;
+}
+
+/* A mapped input that is truncated while it is converted faults on the
+ * pages past its new end. The thread that touched one, converting or
+ * copying, jumps back to where it armed fault and gives up the file;
+ * one that had not armed it dies of the signal as it would have. */
+static _Thread_local sigjmp_buf *fault;
+
+static void onbus(int sig)
+{
+	if (fault) siglongjmp(*fault, 1);
+	signal(sig, SIG_DFL);
+}
+
+/* With -j, a mapped window is cut into chunks at character boundaries
+ * and the chunks are converted by a pool of threads, each with its own
+ * descriptor, then written out in order. A ring of twice as many chunks
+ * as threads bounds the memory held by converted but unwritten output.
+ * Only the UTF encodings and single-byte charsets can be picked up again
+ * at such a boundary, and only targets that neither shift nor start the
+ * output with a byte order mark can be restarted in the middle of it;
+ * anything else is converted serially. */
+#define CHUNK ((size_t)4<<20)
+
+struct chunk {
+	const char *in;
+	size_t inb, skipped;
+	char *out;
+	size_t len, size;
+	int last, done, fault;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t todo, done;
+	struct chunk *ring;
+	size_t n, head, next, tail;
+	int type, fault;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.todo = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* The conversion can be split if the source can be picked up again at
+ * a character boundary, and the target restarted there. */
+static int splittype(void)
+{
+	return stype >= 0 && plaintarget(to, 0) ? stype : -1;
+}
+
+/* Cut before s+n, or shortly before where a character might straddle
+ * it; s[n] must be readable. */
+static size_t cut(int t, const unsigned char *s, size_t n)
+{
+	size_t k;
+
+	switch (t) {
+	case UTF_8:
+		for (k = 0; k < 4 && (s[n-k] & 0xc0) == 0x80; k++);
+		return k < 4 ? n-k : n;
+	case UTF_16LE:
+	case UTF_16BE:
+		n &= -2;
+		return (get16(s+n-2, t == UTF_16BE) & 0xfc00) == 0xd800 ? n-2 : n;
+	case UTF_32LE:
+	case UTF_32BE:
+		return n & -4;
+	}
+	return n;
+}
+
+static void convchunk(struct conv *c, struct chunk *k)
+{
+	char *in = (char *)k->in, *out;
+	size_t inb = k->inb, outb, n;
+
+	k->len = k->skipped = 0;
+	for (;;) {
+		if (k->size - k->len < OUTMIN) {
+			k->size = k->size ? 2*k->size : CHUNK;
+			if (!(k->out = realloc(k->out, k->size))) {
+				perror("iconv");
+				exit(1);
+			}
+		}
+		out = k->out + k->len;
+		outb = k->size - k->len;
+		n = convstep(c, &in, &inb, &out, &outb);
+		k->len = out - k->out;
+		if (n != (size_t)-1 || !inb) break;
+		/* a sequence cut short by the end of a chunk that is not the
+		 * end of the input is as invalid as it would be in one piece */
+		if (errno == EILSEQ || (errno == EINVAL && !k->last)) {
+			n = skip(in, inb);
+			k->skipped += n;
+			if (!omit) break;
+			in += n;
+			inb -= n;
+		} else if (errno != E2BIG) break;
+	}
+	k->in = in;
+	k->inb = inb;
+}
+
+static void *worker(void *c)
+{
+	sigjmp_buf jb;
+	struct chunk *k;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.next == pool.tail)
+			pthread_cond_wait(&pool.todo, &pool.lock);
+		k = &pool.ring[pool.next++ % pool.n];
+		pthread_mutex_unlock(&pool.lock);
+		if (!sigsetjmp(jb, 1)) {
+			fault = &jb;
+			convchunk(c, k);
+		} else k->fault = 1;
+		fault = 0;
+		pthread_mutex_lock(&pool.lock);
+		k->done = 1;
+		pthread_cond_signal(&pool.done);
+	}
+	return 0;
+}
+
+static void startpool(void)
+{
+	struct conv *c;
+	pthread_t t;
+	int i;
+
+	if ((pool.type = splittype()) < 0
+	 || !(pool.ring = calloc(2*jobs, sizeof *pool.ring)))
+		return;
+	for (i = 0; i < jobs; i++) {
+		if (!(c = malloc(sizeof *c))) break;
+		if (conv_open(c, to, from) < 0) {
+			free(c);
+			break;
+		}
+		if (pthread_create(&t, 0, worker, c)) {
+			conv_close(c);
+			free(c);
+			break;
+		}
+		pthread_detach(t);
+	}
+	if (i) pool.n = 2*i;
+}
+
+/* Converts in[0..inb) through the pool and returns how much of it was
+ * left over: an incomplete sequence at the end of the input, or all
+ * that follows where conversion stopped. */
+static size_t convpar(const char *in, size_t inb, int eof, struct obuf *o)
+{
+	const char *end = in + inb;
+	struct chunk *k;
+	size_t n, left = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (inb && !stopped() && pool.tail - pool.head < pool.n) {
+			n = inb > CHUNK
+				? cut(pool.type, (const unsigned char *)in, CHUNK)
+				: inb;
+			k = &pool.ring[pool.tail++ % pool.n];
+			k->in = in;
+			k->inb = n;
+			k->last = eof && n == inb;
+			k->done = k->fault = 0;
+			in += n;
+			inb -= n;
+			pthread_cond_signal(&pool.todo);
+		}
+		if (pool.head == pool.tail) break;
+		k = &pool.ring[pool.head % pool.n];
+		while (!k->done)
+			pthread_cond_wait(&pool.done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+		/* what follows a chunk conversion stopped in is dropped;
+		 * the chunk is left where its conversion ended */
+		if (!stopped()) {
+			owrite(o, k->out, k->len);
+			left = end - k->in;
+		}
+		omitted += k->skipped;
+		pool.fault |= k->fault;
+		pthread_mutex_lock(&pool.lock);
+		pool.head++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return left;
+}
+
+/* Returns -1 if the input is not a mappable regular file, in which case
+ * the caller streams it instead; a mapping failure halfway through
+ * leaves the file offset at the first byte not yet converted. Returns
+ * 1 with errno set if the file could not be read to the end. Like a
+ * read, the conversion moves the file offset, which a shared descriptor
+ * such as a redirected stdin hands on to the next process: past what
+ * was converted, or where conversion stopped. */
+static int convmap(struct conv *c, int fd, struct obuf *o)
+{
+	struct stat st;
+	off_t pos, base;
+	size_t len, inb, outb, k;
+	char *map, *in, *out;
+	sigjmp_buf jb;
+	uint64_t t;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)
+	 || (pos = lseek(fd, 0, SEEK_CUR)) < 0 || pos >= st.st_size)
+		return -1;
+	while (pos < st.st_size) {
+		base = pos & -(off_t)sysconf(_SC_PAGESIZE);
+		len = st.st_size - base < MAPWIN ? st.st_size - base : MAPWIN;
+		t = stats ? clk() : 0;
+		map = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, base);
+		if (map == MAP_FAILED) {
+			lseek(fd, pos, SEEK_SET);
+			return -1;
+		}
+		madvise(map, len, MADV_SEQUENTIAL);
+		if (stats) tally(&cnt.t[T_READ], clk() - t);
+		if (sigsetjmp(jb, 1)) goto truncated;
+		fault = &jb;
+		in = map + (pos - base);
+		inb = len - (pos - base);
+		if (same) {
+			t = stats ? clk() : 0;
+			k = same == COPY_ANY ? inb
+				: same == COPY_ASCII ? alen((unsigned char *)in, inb)
+				: uvalid((unsigned char *)in, inb);
+			if (stats) tally(&cnt.t[T_CONV], clk() - t);
+			ocopy(o, fd, base + (in - map), in, k);
+			in += k;
+			inb -= k;
+		}
+		if (same && inb < 4 && base + len != st.st_size) {
+			/* a character split by the end of the window */
+		} else if (pool.n) {
+			/* the last chunk of a window ends at a boundary, so
+			 * that the next window starts on one */
+			k = base + len == st.st_size ? inb
+				: cut(pool.type, (unsigned char *)in, inb-4);
+			k -= convpar(in, k, base + len == st.st_size, o);
+			in += k;
+			inb -= k;
+			if (pool.fault) goto truncated;
+		} else for (;;) {
+			out = obegin(o, &outb);
+			k = convstep(c, &in, &inb, &out, &outb);
+			oend(o, out);
+			if (k != (size_t)-1 || !inb) break;
+			if (errno == EILSEQ) {
+				k = skip(in, inb);
+				omitted += k;
+				if (!omit) break;
+				in += k;
+				inb -= k;
+			} else if (errno != E2BIG) break;
+		}
+		fault = 0;
+		if (stats) tally(&cnt.in, base + (in - map) - pos);
+		pos = base + (in - map);
+		munmap(map, len);
+		if (stopped()) break;
+		/* incomplete sequence at the end of the file */
+		if (inb && base + len == st.st_size) {
+			omitted += inb;
+			pos = st.st_size;
+			break;
+		}
+	}
+	lseek(fd, pos, SEEK_SET);
+	return 0;
+truncated:
+	fault = 0;
+	pool.fault = 0;
+	munmap(map, len);
+	lseek(fd, 0, SEEK_END);
+	errno = EIO;
+	return 1;
+}
+
+static void convstream(struct conv *c, FILE *f, char *buf, struct obuf *o)
+{
 	char *in, *out;
-	size_t inb;
-	size_t l;
-	size_t unitsize=0;
-	int err=0;
+	size_t inb = 0, outb, insize = iosize(fileno(f));
+	size_t l, k;
+	uint64_t t;
+
+	for (;;) {
+		in = buf;
+		t = stats ? clk() : 0;
+		l = fread(buf+inb, 1, insize-inb, f);
+		if (stats) {
+			tally(&cnt.t[T_READ], clk() - t);
+			tally(&cnt.in, l);
+		}
+		inb += l;
+		if (!inb) break;
+		for (;;) {
+			out = obegin(o, &outb);
+			k = convstep(c, &in, &inb, &out, &outb);
+			oend(o, out);
+			if (k != (size_t)-1 || !inb) break;
+			if (errno == EILSEQ) {
+				k = skip(in, inb);
+				inb-=k;
+				in+=k;
+				omitted+=k;
+				if (!omit) break;
+			} else if (errno != E2BIG) break;
+		}
+		if (inb && !l && errno==EINVAL) {
+			omitted+=inb;
+			break;
+		}
+		if (stopped()) break;
+		if (inb) memmove(buf, in, inb);
+	}
+}
+
+/* Input buffers have room in front for the incomplete character left
+ * over at the end of the one before. An empty buffer ends the input. */
+#define PIPEBUF ((size_t)1<<20)
+#define PIPEHEAD 64
+
+static void *reader(void *p)
+{
+	struct ring *r = p;
+	size_t len;
+	ssize_t k;
+	char *b;
+	int idle;
+	uint64_t t;
+
+	do {
+		pthread_mutex_lock(&r->lock);
+		while (r->tail - r->head == RING)
+			pthread_cond_wait(&r->cond, &r->lock);
+		pthread_mutex_unlock(&r->lock);
+		b = r->buf[r->tail % RING] + PIPEHEAD;
+		for (len = 0; len < PIPEBUF; len += k) {
+			t = stats ? clk() : 0;
+			k = read(r->fd, b+len, PIPEBUF-len);
+			if (stats) tally(&cnt.t[T_READ], clk() - t);
+			if (k > 0) {
+				if (stats) tally(&cnt.in, k);
+				/* a slow source is not waited on for a
+				 * full buffer while there is nothing else
+				 * to convert */
+				pthread_mutex_lock(&r->lock);
+				idle = r->idle;
+				pthread_mutex_unlock(&r->lock);
+				if (idle && len+k >= IOMAX) {
+					len += k;
+					break;
+				}
+				continue;
+			}
+			if (k < 0 && errno == EINTR) k = 0;
+			else break;
+		}
+		pthread_mutex_lock(&r->lock);
+		if (k < 0) r->err = errno;
+		r->len[r->tail++ % RING] = len;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	} while (len);
+	return 0;
+}
+
+static int cpus(void)
+{
+	cpu_set_t set;
+
+	return sched_getaffinity(0, sizeof set, &set) ? 1 : CPU_COUNT(&set);
+}
+
+/* Converts fd through the read and write threads of -p, returning -1
+ * if it could not be read to the end. */
+static int convpipe(struct conv *c, int fd, struct obuf *o)
+{
+	static struct ring r = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	char *in = 0, *out;
+	size_t inb = 0, outb, len, k;
+	unsigned n;
+	pthread_t t;
+	int i;
+
+	for (i = 0; i < RING; i++)
+		if (!r.buf[i] && !(r.buf[i] = malloc(PIPEHEAD + PIPEBUF))) {
+			perror("iconv");
+			exit(1);
+		}
+	r.fd = fd;
+	r.err = 0;
+	r.head = r.tail = 0;
+	if (pthread_create(&t, 0, reader, &r)) {
+		perror("iconv");
+		exit(1);
+	}
+	for (n = 0;; n++) {
+		pthread_mutex_lock(&r.lock);
+		r.idle = 1;
+		while (r.tail == n)
+			pthread_cond_wait(&r.cond, &r.lock);
+		r.idle = 0;
+		pthread_mutex_unlock(&r.lock);
+		/* what conversion left of the last buffer is an incomplete
+		 * character, carried over in front of this one before the
+		 * last is given back to the reader */
+		i = n % RING;
+		len = r.len[i];
+		if (inb) memmove(r.buf[i] + PIPEHEAD - inb, in, inb);
+		in = r.buf[i] + PIPEHEAD - inb;
+		pthread_mutex_lock(&r.lock);
+		r.head = n;
+		pthread_cond_signal(&r.cond);
+		pthread_mutex_unlock(&r.lock);
+		if (!len && !pool.n) break;
+		inb += len;
+		if (pool.n && (inb > 4 || !len)) {
+			/* as with a window of a mapping, every chunk but the
+			 * last at the end of the input ends at a boundary */
+			k = len ? cut(pool.type, (unsigned char *)in, inb-4) : inb;
+			k -= convpar(in, k, !len, o);
+			in += k;
+			inb -= k;
+		} else for (;;) {
+			out = obegin(o, &outb);
+			k = convstep(c, &in, &inb, &out, &outb);
+			oend(o, out);
+			if (k != (size_t)-1 || !inb) break;
+			if (errno == EILSEQ) {
+				k = skip(in, inb);
+				in += k;
+				inb -= k;
+				omitted += k;
+				if (!omit) break;
+			} else if (errno != E2BIG) break;
+		}
+		if (!len) break;
+		if (stopped()) {
+			/* iconv goes no further, and does not wait for the
+			 * reader to get to the end */
+			pthread_detach(t);
+			return 0;
+		}
+	}
+	pthread_join(t, 0);
+	omitted += inb;
+	if (r.err) {
+		errno = r.err;
+		return -1;
+	}
+	return 0;
+}
+
+static double mb(uint64_t *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED) / 1e6;
+}
+
+static double secs(uint64_t *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED) / 1e9;
+}
+
+static void *progress(void *p)
+{
+	double t;
+
+	for (;;) {
+		sleep(1);
+		t = (clk() - start) / 1e9;
+		fprintf(stderr, "iconv: %.1f MB in, %.1f MB out, %.1f MB/s, "
+			"%llu invalid\n", mb(&cnt.in), mb(&cnt.out),
+			mb(&cnt.in) / t, (unsigned long long)
+			__atomic_load_n(&cnt.invalid, __ATOMIC_RELAXED));
+	}
+	return 0;
+}
+
+/* One line of key=value pairs for scripts, printed on the way out. */
+static void summary(void)
+{
+	double t = (clk() - start) / 1e9;
+
+	fprintf(stderr, "iconv: stats in=%llu out=%llu seconds=%.3f "
+		"mbps=%.2f invalid=%llu omitted=%llu "
+		"read=%.3f convert=%.3f write=%.3f\n",
+		(unsigned long long)cnt.in, (unsigned long long)cnt.out, t,
+		mb(&cnt.in) / t, (unsigned long long)cnt.invalid,
+		(unsigned long long)cnt.omitted, secs(&cnt.t[T_READ]),
+		secs(&cnt.t[T_CONV]), secs(&cnt.t[T_WRITE]));
+}
+
+/* Returns whether any of the file could not be converted. */
+static int omitreport(const char *name)
+{
+	size_t n = omitted;
+
+	if (n && !omit)
+		fprintf(stderr, "iconv: %s: cannot convert\n", name);
+	else if (n && report)
+		fprintf(stderr, "iconv: %s: %zu bytes could not be "
+			"converted and were omitted\n", name, n);
+	if (stats) tally(&cnt.omitted, n);
+	omitted = 0;
+	return n != 0;
+}
+
+/* With --output-dir, every input is converted to a file of the same
+ * base name in the given directory, as cp(1) would copy it there, and
+ * is ended in the initial shift state so that it stands on its own. The
+ * files are shared out among -j threads, each keeping its descriptor
+ * and buffers from one file to the next. With no input named, the names
+ * are read from stdin, one per line. Inputs of the same base name would
+ * write the same file: whichever gets to it first takes it, and the
+ * others are errors. */
+struct bworker {
+	struct conv c;
+	struct obuf o;
+	char *buf, *line;
+	size_t size;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int dir, err;
+	char **argv;
+	void *names;
+} batch = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static char *nextname(struct bworker *w)
+{
+	char *name = 0;
+	ssize_t n;
+
+	pthread_mutex_lock(&batch.lock);
+	if (batch.argv) {
+		name = *batch.argv;
+		if (name) batch.argv++;
+	} else while ((n = getline(&w->line, &w->size, stdin)) > 0) {
+		if (w->line[n-1] == '\n') w->line[--n] = 0;
+		if (n) {
+			name = w->line;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&batch.lock);
+	return name;
+}
+
+/* Whether base has not been taken as an output name yet, taking it. */
+static int claim(const char *base)
+{
+	char *p, **q;
+
+	if (!(p = strdup(base))) {
+		perror("iconv");
+		exit(1);
+	}
+	pthread_mutex_lock(&batch.lock);
+	q = tsearch(p, &batch.names, (int (*)(const void *, const void *))strcmp);
+	pthread_mutex_unlock(&batch.lock);
+	if (!q) {
+		perror("iconv");
+		exit(1);
+	}
+	if (*q == p) return 1;
+	free(p);
+	return 0;
+}
+
+static void convreset(struct conv *c, struct obuf *o)
+{
+	char *out;
+	size_t outb;
+
+	if (c->dec) iconv(c->dec->cd, 0, 0, 0, 0);
+	if (c->cd == (iconv_t)-1) return;
+	out = obegin(o, &outb);
+	iconv(c->cd, 0, 0, &out, &outb);
+	oend(o, out);
+}
+
+static int convfile(struct bworker *w, const char *name)
+{
+	const char *base = strrchr(name, '/') ? strrchr(name, '/')+1 : name;
+	struct stat in, out;
+	FILE *f;
+	int fd, r, err = 0;
+
+	if (!(f = fopen(name, "rb")) || fstat(fileno(f), &in)) goto fail;
+	if (!*base || S_ISDIR(in.st_mode)) {
+		errno = EISDIR;
+		goto fail;
+	}
+	if (!claim(base)) {
+		fprintf(stderr, "iconv: %s: output %s is written from "
+			"another input\n", name, base);
+		fclose(f);
+		return 1;
+	}
+	/* do not truncate the input when it is where the output goes */
+	if (!fstatat(batch.dir, base, &out, 0)
+	 && in.st_dev == out.st_dev && in.st_ino == out.st_ino) {
+		fprintf(stderr, "iconv: %s: input and output are the same file\n", name);
+		fclose(f);
+		return 1;
+	}
+	fd = openat(batch.dir, base, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (fd < 0) goto fail;
+	oopen(&w->o, fd);
+	if ((r = convmap(&w->c, fileno(f), &w->o)) < 0)
+		convstream(&w->c, f, w->buf, &w->o);
+	convreset(&w->c, &w->o);
+	oflush(&w->o);
+	if (r > 0 || ferror(f)) {
+		fprintf(stderr, "iconv: %s: ", name);
+		perror("");
+		err = 1;
+	}
+	if (close(fd)) {
+		perror("iconv: write error");
+		err = 1;
+	}
+	if (omitreport(name)) err = 1;
+	fclose(f);
+	return err;
+fail:
+	fprintf(stderr, "iconv: %s: ", name);
+	perror("");
+	if (f) fclose(f);
+	return 1;
+}
+
+static void *batchworker(void *p)
+{
+	struct bworker *w = p;
+	char *name;
+
+	while ((name = nextname(w)))
+		if (convfile(w, name)) {
+			pthread_mutex_lock(&batch.lock);
+			batch.err = 1;
+			pthread_mutex_unlock(&batch.lock);
+		}
+	return 0;
+}
+
+static int convbatch(struct conv *c, char *buf, const char *dir, char **argv)
+{
+	struct bworker *w;
+	pthread_t *t;
+	int i, n;
+
+	if ((batch.dir = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+		fprintf(stderr, "iconv: %s: ", dir);
+		perror("");
+		return 1;
+	}
+	batch.argv = *argv ? argv : 0;
+	if (!(w = calloc(jobs, sizeof *w)) || !(t = calloc(jobs, sizeof *t))) {
+		perror("iconv");
+		return 1;
+	}
+	w[0].c = *c;
+	w[0].buf = buf;
+	for (n = 1; n < jobs; n++) {
+		if (conv_open(&w[n].c, to, from) < 0
+		 || !(w[n].buf = malloc(IOMAX)))
+			break;
+		if (pthread_create(&t[n], 0, batchworker, &w[n])) {
+			conv_close(&w[n].c);
+			break;
+		}
+	}
+	batchworker(&w[0]);
+	for (i = 1; i < n; i++)
+		pthread_join(t[i], 0);
+	return batch.err;
+}
+
+/* With -o, output goes to the named file, as with GNU iconv. It is
+ * only truncated once it is known not to be one of the inputs, which
+ * would otherwise be read back empty. */
+static int openout(const char *name, char **in, int n)
+{
+	struct stat out, st;
+	int fd, r;
+
+	if ((fd = open(name, O_WRONLY|O_CREAT|O_CLOEXEC, 0666)) < 0
+	 || fstat(fd, &out))
+		goto fail;
+	if (!S_ISREG(out.st_mode)) return fd;
+	for (; n; in++, n--) {
+		r = strcmp(*in, "-") ? stat(*in, &st) : fstat(0, &st);
+		if (!r && st.st_dev == out.st_dev && st.st_ino == out.st_ino) {
+			fprintf(stderr, "iconv: %s: input and output are the same file\n", *in);
+			exit(1);
+		}
+	}
+	if (!ftruncate(fd, 0)) return fd;
+fail:
+	fprintf(stderr, "iconv: %s: ", name);
+	perror("");
+	exit(1);
+}
+
+static void usage(FILE *f)
+{
+	fputs("usage: iconv [-cps] [-f from] [-t to] [-o file] [-j jobs]\n"
+		"             [--stats | --progress] [file ...]\n"
+		"       iconv [-cs] [-f from] [-t to] [-j jobs] --output-dir dir\n"
+		"             [--stats | --progress] [file ...]\n"
+		"       iconv -l\n", f);
+}
+
+int main(int argc, char **argv)
+{
+	int b, r = 0;
+	struct conv c;
+	char *buf;
+	int err=0, cflag=0, sflag=0, pflag=0;
+	char *end, *dir=0, *ofile=0;
 	FILE *f;
+	pthread_t t;
+	static const struct option lopts[] = {
+		{ "stats", no_argument, &stats, STATS },
+		{ "progress", no_argument, &stats, STATS|PROGRESS },
+		{ "output-dir", required_argument, 0, 'O' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0 }
+	};
 
-	while ((b = getopt(argc, argv, "f:t:csl")) != EOF) switch(b) {
+	while ((b = getopt_long(argc, argv, "f:t:o:csplj:", lopts, 0)) != EOF) switch(b) {
+	case 0: break;
+	case 'h':
+		usage(stdout);
+		exit(0);
 	case 'l':
 		puts("UTF-8, UTF-16BE, UTF-16LE, UTF-32BE, UTF32-LE, UCS-2BE, UCS-2LE, WCHAR_T,\n"
 			"US_ASCII, ISO8859-1, ISO8859-2, ISO8859-3, ISO8859-4, ISO8859-5,\n"
 			"ISO8859-6, ISO8859-7, ...");
 		exit(0);
-	case 'c': case 's': break;
+	case 'c': cflag=1; break;
+	case 's': sflag=1; break;
+	case 'p': pflag=1; break;
 	case 'f': from=optarg; break;
 	case 't': to=optarg; break;
-	default: exit(1);
+	case 'o': ofile=optarg; break;
+	case 'O': dir=optarg; break;
+	case 'j':
+		jobs = strtol(optarg, &end, 10);
+		if (*end || jobs < 1) {
+			fprintf(stderr, "iconv: invalid job count: %s\n", optarg);
+			exit(1);
+		}
+		break;
+	default:
+		usage(stderr);
+		exit(1);
+	}
+	if (dir && (ofile || pflag)) {
+		fprintf(stderr, "iconv: --output-dir cannot be used with %s\n",
+			ofile ? "-o" : "-p");
+		exit(1);
 	}
 
 	if (!from || !to) {
@@ -45,16 +1897,37 @@ int main(int argc, char **argv)
 		if (!to) to = nl_langinfo(CODESET);
 		if (!from) from = nl_langinfo(CODESET);
 	}
-	cd = iconv_open(to, from);
-	if (cd == (iconv_t)-1) {
-		if (iconv_open(to, "WCHAR_T") == (iconv_t)-1)
+	if (conv_open(&c, to, from) < 0) {
+		if (conv_open(&c, to, "WCHAR_T") < 0)
 			fprintf(stderr, "iconv: destination charset %s: ", to);
 		else
 			fprintf(stderr, "iconv: source charset %s: ", from);
 		perror("");
 		exit(1);
 	}
+	if (!(buf = malloc(IOMAX))) {
+		perror("iconv");
+		exit(1);
+	}
+	sigaction(SIGBUS, &(struct sigaction){ .sa_handler = onbus }, 0);
+	omit = cflag;
+	report = !sflag;
+	same = copytype();
+	srcprobe();
+	if (stats) {
+		start = clk();
+		atexit(summary);
+	}
+	if ((stats & PROGRESS) && !pthread_create(&t, 0, progress, 0))
+		pthread_detach(t);
+	if (dir) return convbatch(&c, buf, dir, argv+optind);
 	if (optind == argc) argv[argc++] = "-";
+	oopen(&ob, ofile ? openout(ofile, argv+optind, argc-optind) : 1);
+	if (pflag) {
+		ostart(&ob);
+		pflag = cpus() > 1;
+	}
+	if (jobs > 1) startpool();
 
 	for (; optind < argc; optind++) {
 		if (argv[optind][0]=='-' && !argv[optind][1]) {
@@ -66,45 +1939,30 @@ int main(int argc, char **argv)
 			err = 1;
 			continue;
 		}
-		inb = 0;
-		for (;;) {
-			in = buf;
-			out = outbuf;
-			l = fread(buf+inb, 1, sizeof(buf)-inb, f);
-			inb += l;
-			if (!inb) break;
-			if (iconv(cd, &in, &inb, &out, (size_t [1]){sizeof outbuf})==-1
-			 && errno == EILSEQ) {
-				if (!unitsize) {
-					wchar_t wc='0';
-					char dummy[4], *dummyp=dummy;
-					iconv_t cd2 = iconv_open(from, "WCHAR_T");
-					if (cd == (iconv_t)-1) {
-						unitsize = 1;
-					} else {
-						iconv(cd2,
-							(char *[1]){(char *)&wc},
-							(size_t[1]){1},
-							&dummyp, (size_t[1]){4});
-						unitsize = dummyp-dummy;
-						if (!unitsize) unitsize=1;
-					}
-				}
-				inb-=unitsize;
-				in+=unitsize;
+		if (pflag) {
+			if (convpipe(&c, fileno(f), &ob) < 0) {
+				fprintf(stderr, "iconv: %s: ", argv[optind]);
+				perror("");
+				err = 1;
 			}
-			if (inb && !l && errno==EINVAL) break;
-			if (out>outbuf && !fwrite(outbuf, out-outbuf, 1, stdout)) {
-				perror("iconv: write error");
-				exit(1);
-			}
-			if (inb) memmove(buf, in, inb);
-		}
-		if (ferror(f)) {
+		} else if ((r = convmap(&c, fileno(f), &ob)) < 0)
+			convstream(&c, f, buf, &ob);
+		if (r > 0 || ferror(f)) {
 			fprintf(stderr, "iconv: %s: ", argv[optind]);
 			perror("");
 			err = 1;
 		}
+		if (f != stdin) fclose(f);
+		if (omitreport(argv[optind])) {
+			err = 1;
+			if (!omit) break;
+		}
+	}
+	oflush(&ob);
+	odrain(&ob);
+	if (ofile && close(ob.fd)) {
+		perror("iconv: write error");
+		err = 1;
 	}
 	return err;
 }
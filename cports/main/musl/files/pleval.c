@@ -0,0 +1,359 @@
+/*
+ * Replacement for musl's src/locale/pleval.c, copied over it in
+ * post_extract. The Plural-Forms expression of a catalog used to be
+ * parsed again on every ngettext() call; it is now compiled once into
+ * a small stack program, which later calls with the same rule run.
+ * The parser below is still the reference: the compiler follows it
+ * production by production, and it is used as is for rules that do
+ * not fit in the program cache.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "pleval.h"
+#include "atomic.h"
+
+/*
+grammar:
+
+Start = Expr ';'
+Expr  = Or | Or '?' Expr ':' Expr
+Or    = And | Or '||' And
+And   = Eq | And '&&' Eq
+Eq    = Rel | Eq '==' Rel | Eq '!=' Rel
+Rel   = Add | Rel '<=' Add | Rel '>=' Add | Rel '<' Add | Rel '>' Add
+Add   = Mul | Add '+' Mul | Add '-' Mul
+Mul   = Prim | Mul '*' Prim | Mul '/' Prim | Mul '%' Prim
+Prim  = '(' Expr ')' | '!' Prim | decimal | 'n'
+
+internals:
+
+recursive descent expression evaluator with stack depth limit.
+for binary operators an operator-precedence parser is used.
+eval* functions store the result of the parsed subexpression
+and return a pointer to the next non-space character.
+
+the compiler (comp* functions) walks the same productions but
+emits postfix code instead of values; operators are evaluated
+on both sides (no short-circuit) and a zero divisor fails the
+whole rule, exactly as in the evaluator.
+*/
+
+struct st {
+	unsigned long r;
+	unsigned long n;
+	int op;
+};
+
+static const char *skipspace(const char *s)
+{
+	while (isspace(*s)) s++;
+	return s;
+}
+
+static const char *evalexpr(struct st *st, const char *s, int d);
+
+static const char *evalprim(struct st *st, const char *s, int d)
+{
+	char *e;
+	if (--d < 0) return "";
+	s = skipspace(s);
+	if (isdigit(*s)) {
+		st->r = strtoul(s, &e, 10);
+		if (e == s || st->r == -1) return "";
+		return skipspace(e);
+	}
+	if (*s == 'n') {
+		st->r = st->n;
+		return skipspace(s+1);
+	}
+	if (*s == '(') {
+		s = evalexpr(st, s+1, d);
+		if (*s != ')') return "";
+		return skipspace(s+1);
+	}
+	if (*s == '!') {
+		s = evalprim(st, s+1, d);
+		st->r = !st->r;
+		return s;
+	}
+	return "";
+}
+
+static int binop(unsigned long *r, int op, unsigned long left)
+{
+	unsigned long a = left, b = *r;
+	switch (op) {
+	case 0: *r = a||b; return 0;
+	case 1: *r = a&&b; return 0;
+	case 2: *r = a==b; return 0;
+	case 3: *r = a!=b; return 0;
+	case 4: *r = a>=b; return 0;
+	case 5: *r = a<=b; return 0;
+	case 6: *r = a>b; return 0;
+	case 7: *r = a<b; return 0;
+	case 8: *r = a+b; return 0;
+	case 9: *r = a-b; return 0;
+	case 10: *r = a*b; return 0;
+	case 11: if (b) {*r = a%b; return 0;} return 1;
+	case 12: if (b) {*r = a/b; return 0;} return 1;
+	}
+	return 1;
+}
+
+static const char *parseop(int *op, const char *s)
+{
+	static const char opch[11] = "|&=!><+-*%/";
+	static const char opch2[6] = "|&====";
+	int i;
+	for (i=0; i<11; i++)
+		if (*s == opch[i]) {
+			/* note: >,< are accepted with or without = */
+			if (i<6 && s[1] == opch2[i]) {
+				*op = i;
+				return s+2;
+			}
+			if (i>=4) {
+				*op = i+2;
+				return s+1;
+			}
+			break;
+		}
+	*op = 13;
+	return s;
+}
+
+static const char prec[14] = {1,2,3,3,4,4,4,4,5,5,6,6,6,0};
+
+static const char *evalbinop(struct st *st, const char *s, int minprec, int d)
+{
+	unsigned long left;
+	int op;
+	d--;
+	s = evalprim(st, s, d);
+	s = parseop(&st->op, s);
+	for (;;) {
+		/*
+		st->r (left hand side value) and st->op are now set,
+		get the right hand side or back out if op has low prec,
+		if op was missing then prec[op]==0
+		*/
+		op = st->op;
+		if (prec[op] <= minprec)
+			return s;
+		left = st->r;
+		s = evalbinop(st, s, prec[op], d);
+		if (binop(&st->r, op, left))
+			return "";
+	}
+}
+
+static const char *evalexpr(struct st *st, const char *s, int d)
+{
+	unsigned long a, b;
+	if (--d < 0)
+		return "";
+	s = evalbinop(st, s, 0, d);
+	if (*s != '?')
+		return s;
+	a = st->r;
+	s = evalexpr(st, s+1, d);
+	if (*s != ':')
+		return "";
+	b = st->r;
+	s = evalexpr(st, s+1, d);
+	st->r = a ? b : st->r;
+	return s;
+}
+
+/* postfix code: 0..12 are the binary operators as numbered by
+ * parseop, the rest push or combine stack values */
+enum { I_N = 13, I_NUM, I_NOT, I_COND };
+
+#define PLMAX 128
+
+struct ins {
+	unsigned long k;
+	int op;
+};
+
+struct prog {
+	const char *rule;
+	size_t len;
+	int n;
+	struct ins code[PLMAX];
+	char text[];
+};
+
+static int emit(struct prog *p, int op, unsigned long k)
+{
+	if (p->n == PLMAX) return -1;
+	p->code[p->n++] = (struct ins){ .op = op, .k = k };
+	return 0;
+}
+
+static const char *compexpr(struct prog *p, const char *s, int d);
+
+static const char *compprim(struct prog *p, const char *s, int d)
+{
+	unsigned long k;
+	char *e;
+	if (--d < 0) return "";
+	s = skipspace(s);
+	if (isdigit(*s)) {
+		k = strtoul(s, &e, 10);
+		if (e == s || k == -1 || emit(p, I_NUM, k)) return "";
+		return skipspace(e);
+	}
+	if (*s == 'n') {
+		if (emit(p, I_N, 0)) return "";
+		return skipspace(s+1);
+	}
+	if (*s == '(') {
+		s = compexpr(p, s+1, d);
+		if (*s != ')') return "";
+		return skipspace(s+1);
+	}
+	if (*s == '!') {
+		s = compprim(p, s+1, d);
+		if (emit(p, I_NOT, 0)) return "";
+		return s;
+	}
+	return "";
+}
+
+static const char *compbinop(struct prog *p, const char *s, int minprec, int d, int *op)
+{
+	int o;
+	d--;
+	s = compprim(p, s, d);
+	s = parseop(op, s);
+	for (;;) {
+		o = *op;
+		if (prec[o] <= minprec)
+			return s;
+		s = compbinop(p, s, prec[o], d, op);
+		if (emit(p, o, 0))
+			return "";
+	}
+}
+
+static const char *compexpr(struct prog *p, const char *s, int d)
+{
+	int op;
+	if (--d < 0)
+		return "";
+	s = compbinop(p, s, 0, d, &op);
+	if (*s != '?')
+		return s;
+	s = compexpr(p, s+1, d);
+	if (*s != ':')
+		return "";
+	s = compexpr(p, s+1, d);
+	if (emit(p, I_COND, 0))
+		return "";
+	return s;
+}
+
+static unsigned long run(const struct prog *p, unsigned long n)
+{
+	unsigned long st[PLMAX], *sp = st;
+	const struct ins *i, *e = p->code + p->n;
+
+	for (i = p->code; i < e; i++) {
+		switch (i->op) {
+		case I_N:
+			*sp++ = n;
+			break;
+		case I_NUM:
+			*sp++ = i->k;
+			break;
+		case I_NOT:
+			sp[-1] = !sp[-1];
+			break;
+		case I_COND:
+			sp -= 2;
+			sp[-1] = sp[-1] ? sp[0] : sp[1];
+			break;
+		default:
+			sp--;
+			if (binop(sp, i->op, sp[-1])) return -1;
+			sp[-1] = sp[0];
+		}
+	}
+	return sp[-1];
+}
+
+/* compiled rules, never freed: catalogs stay mapped for the life of
+ * the process, so a handful of slots covers every rule in use. a rule
+ * is found by its address, and its text is compared to be sure */
+static struct prog *volatile cache[8];
+
+static int match(const struct prog *p, const char *s)
+{
+	return p->rule == s && !strncmp(p->text, s, p->len);
+}
+
+static const struct prog *lookup(const char *s, int *full)
+{
+	struct prog *p;
+	size_t i;
+
+	for (i = 0; i < sizeof cache / sizeof *cache; i++) {
+		if (!(p = cache[i])) break;
+		if (match(p, s)) return p;
+	}
+	*full = i == sizeof cache / sizeof *cache;
+	return 0;
+}
+
+static const struct prog *compile(const char *s)
+{
+	struct prog *p, *z;
+	const char *e;
+	size_t i;
+
+	if (!(p = malloc(sizeof *p))) return 0;
+	p->n = 0;
+	e = compexpr(p, s, 100);
+	if (*e != ';') {
+		/* a rule that never evaluates is kept as an empty program,
+		 * unless it only failed because it did not fit */
+		if (p->n == PLMAX) {
+			free(p);
+			return 0;
+		}
+		p->n = 0;
+		e = s + strcspn(s, ";");
+	}
+	p->rule = s;
+	p->len = e - s;
+	if (!(z = realloc(p, sizeof *p + p->len))) {
+		free(p);
+		return 0;
+	}
+	p = z;
+	memcpy(p->text, s, p->len);
+	for (i = 0; i < sizeof cache / sizeof *cache; i++) {
+		if (!(z = a_cas_p(&cache[i], 0, p)))
+			return p;
+		if (match(z, s))
+			break;
+	}
+	free(p);
+	return lookup(s, &(int){0});
+}
+
+unsigned long __pleval(const char *s, unsigned long n)
+{
+	const struct prog *p;
+	struct st st;
+	int full;
+
+	if (!(p = lookup(s, &full)) && !full) p = compile(s);
+	if (p) return p->n ? run(p, n) : -1;
+	st.n = n;
+	s = evalexpr(&st, s, 100);
+	return *s == ';' ? st.r : -1;
+}
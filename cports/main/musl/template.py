@@ -1,6 +1,6 @@
 pkgname = "musl"
 pkgver = "1.2.5_git20240705"
-pkgrel = 10
+pkgrel = 30
 _commit = "dd1e63c3638d5f9afb857fccf6ce1415ca5f1b8b"
 _mimalloc_ver = "2.1.7"
 build_style = "gnu_configure"
@@ -26,7 +26,8 @@ sha256 = [
 compression = "deflate"
 # scp makes it segfault
 hardening = ["!scp"]
-# does not ship tests
+# does not ship tests; check runs the iconv benchmark instead, which
+# takes a while and wants a quiet host, so only with --force-check
 options = ["bootstrap", "!check", "!lto"]
 
 # whether to use musl's stock allocator
@@ -61,6 +62,10 @@ def post_extract(self):
     # copy in our mimalloc unified source
     self.cp(self.files_path / "mimalloc-verify-syms.sh", ".")
     self.cp(self.files_path / "mimalloc.c", "mimalloc/src")
+    # catalog lookup through the .mo hash table
+    self.cp(self.files_path / "__mo_lookup.c", "src/locale")
+    # plural rules compiled once per catalog
+    self.cp(self.files_path / "pleval.c", "src/locale")
     # now we're ready to get patched
     # but also remove musl's x86_64 asm memcpy as it's actually
     # noticeably slower than the c implementation
@@ -101,6 +106,26 @@ def post_build(self):
     )
 
 
+def check(self):
+    from cbuild.util import compiler
+
+    # results are compared with files/iconv-bench.baseline if there is
+    # one, and recorded in the build directory as one otherwise; it only
+    # means something on the host that recorded it, so none is shipped
+    self.cp(self.files_path / "iconv-bench.c", ".")
+    compiler.C(self).invoke(["iconv-bench.c"], "iconv-bench")
+    # both the benchmark and the utility run under the libc just built,
+    # through its dynamic linker, not the one in the build root
+    ldso = f"{self.make_dir}/lib/libc.so"
+    bench = [ldso, "./iconv-bench", "-l", ldso, "-u", "./iconv"]
+    if (self.files_path / "iconv-bench.baseline").is_file():
+        self.cp(self.files_path / "iconv-bench.baseline", ".")
+        self.do(*bench, "-b", "iconv-bench.baseline")
+    else:
+        self.do(*bench, "-w", "iconv-bench.baseline")
+        self.log(f"iconv baseline recorded in {self.cwd}/iconv-bench.baseline")
+
+
 def pre_install(self):
     self.install_dir("usr/lib")
     # ensure all files go in /usr/lib
@@ -127,6 +152,7 @@ def post_install(self):
 
     self.install_file("libssp_nonshared.a", "usr/lib")
 
+    self.install_man(self.files_path / "iconv.1")
     self.install_man(self.files_path / "getent.1")
     self.install_man(self.files_path / "getconf.1")
 